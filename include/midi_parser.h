@@ -71,6 +71,7 @@ typedef struct
 
 typedef struct
 {
+    // chunk length as read from the file; apply_track_edit leaves it stale
     uint32_t    size;
     MTrk_event *events;
     size_t      count;
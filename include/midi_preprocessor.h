@@ -6,11 +6,15 @@
 #include "midi_parser.h"
 
 
+#define TEMPO_DEFAULT_TRACK  UINT16_MAX
+
 typedef struct
 {
     uint64_t tick;
     uint32_t us_per_qn;
     double bpm;
+    uint16_t track_idx;
+    size_t   event_idx;
 } Tempo_change;
 
 typedef struct
@@ -20,10 +24,24 @@ typedef struct
     size_t        cap;
 } Tempo_map;
 
+typedef struct
+{
+    const Tempo_map *tmap;
+    uint64_t         den;
+    uint32_t         sample_rate;
+    uint8_t          is_fps;
+    size_t           next_change;
+    uint64_t         seg_tick;
+    uint64_t         seg_num;
+    uint32_t         us_per_qn;
+} Tick_clock;
+
 typedef struct
 {
     double      timestamp_ms;
-    uint8_t     track_idx;
+    uint64_t    tick;
+    uint64_t    sample;
+    uint16_t    track_idx;
     MTrk_event *event;
 } Timed_event;
 
@@ -32,16 +50,191 @@ typedef struct
     Timed_event *events;
     size_t       count;
     size_t       cap;
+    uint32_t     sample_rate;
 } Timeline;
 
+// RC_PROGRAM carries the program in value; RC_CONTROL carries the
+// controller number in note and its value in value; RC_PITCH_BEND carries
+// the low 7 bits of the bend in note and the high 7 in value; RC_TEMPO
+// carries the 24-bit microseconds per quarter note in channel, note and
+// value, high byte first (see render_cmd_tempo)
+typedef enum
+{
+    RC_NOTE_OFF,
+    RC_NOTE_ON,
+    RC_PROGRAM,
+    RC_CONTROL,
+    RC_PITCH_BEND,
+    RC_TEMPO
+} Render_op;
+
+typedef struct
+{
+    uint64_t sample;
+    uint8_t  op;
+    uint8_t  channel;
+    uint8_t  note;
+    uint8_t  value;
+} Render_cmd;
+
+typedef struct
+{
+    Render_cmd *cmds;
+    size_t      count;
+    size_t      cap;
+    uint32_t    sample_rate;
+    uint64_t    end_sample;
+} Render_stream;
+
+typedef struct
+{
+    uint64_t start_sample;
+    uint64_t duration;
+    uint16_t track_idx;
+    uint8_t  channel;
+    uint8_t  pitch;
+    uint8_t  velocity;
+} Note;
+
+typedef struct
+{
+    Note    *notes;
+    size_t   count;
+    size_t   cap;
+    uint32_t sample_rate;
+} Note_list;
+
+typedef struct
+{
+    uint64_t start_sample;
+    uint8_t  channel;
+    uint8_t  note;
+    uint8_t  velocity;
+} Held_note;
+
+typedef struct
+{
+    uint64_t sample;
+    size_t   timeline_pos;
+    size_t   stream_pos;
+    size_t   first_note;
+    size_t   note_count;
+    uint32_t us_per_qn;
+    // quarter notes the synth has counted by `sample`
+    double   beat;
+    uint16_t pitch_bend[16];
+    uint8_t  program[16];
+    uint8_t  controllers[16][128];
+    // the registered parameter selected, as the synth tracks it, and the
+    // bend range RPN 0 last set
+    uint8_t  rpn_msb[16];
+    uint8_t  rpn_lsb[16];
+    uint8_t  bend_semitones[16];
+    uint8_t  bend_cents[16];
+} Keyframe;
+
+typedef struct
+{
+    Keyframe  *keyframes;
+    size_t     count;
+    size_t     cap;
+    Held_note *notes;
+    size_t     note_count;
+    size_t     note_cap;
+    uint64_t   interval;
+} Seek_index;
+
+typedef struct
+{
+    uint32_t peak;
+    double   average;
+} Polyphony_stats;
+
+typedef struct
+{
+    uint64_t end_sample;
+    uint32_t count;
+} Release_span;
+
+typedef struct
+{
+    uint64_t      release_samples;
+    uint64_t      last_sample;
+    uint64_t      voice_samples;
+    uint32_t      active;
+    uint32_t      peak;
+    uint16_t      held[16 * 128];
+    Release_span *pending;
+    size_t        pending_head;
+    size_t        pending_count;
+    size_t        pending_cap;
+} Polyphony_scan;
+
+// replaces remove_count events of a track from `first` on with the insert
+// events; tick is the absolute tick of the event before `first`, 0 when
+// first is 0
+typedef struct
+{
+    uint16_t          track_idx;
+    size_t            first;
+    uint64_t          tick;
+    size_t            remove_count;
+    const MTrk_event *insert;
+    size_t            insert_count;
+} Track_edit;
+
+typedef struct
+{
+    size_t   pos;
+    uint64_t tick;
+} Track_cursor;
+
+typedef struct
+{
+    const MIDI_file *midi;
+    Tick_clock       clk;
+    Track_cursor    *cursors;
+    uint16_t        *heap;
+    size_t           heap_count;
+} Timeline_stream;
+
 
 Tempo_map build_tempo_map(const MIDI_file *midi, int *status);
 void      free_tempo_map(Tempo_map *tmap);
 
-double tick_to_milliseconds(uint64_t tick, const MThd *mthd, const Tempo_map *tmap);
+double   tick_to_milliseconds(uint64_t tick, const MThd *mthd, const Tempo_map *tmap);
+uint64_t tick_to_sample(uint64_t tick, const MThd *mthd, const Tempo_map *tmap, uint32_t sample_rate);
 
-Timeline merge_tracks_to_timeline(const MIDI_file *midi, const Tempo_map *tmap, int *status);
+Timeline merge_tracks_to_timeline(const MIDI_file *midi, const Tempo_map *tmap, uint32_t sample_rate, int *status);
+Timeline merge_tracks_to_timeline_parallel(const MIDI_file *midi, const Tempo_map *tmap, uint32_t sample_rate,
+                                           unsigned nthreads, int *status);
 void     free_timeline(Timeline *timeline);
 
+int apply_track_edit(MIDI_file *midi, Tempo_map *tmap, Timeline *timeline, const Track_edit *edit);
+
+int           render_cmd_from_event(const Timed_event *tev, Render_cmd *cmd);
+uint32_t      render_cmd_tempo(const Render_cmd *cmd);
+Render_stream build_render_stream(const Timeline *timeline, int *status);
+void          free_render_stream(Render_stream *rs);
+
+Timeline_stream open_timeline_stream(const MIDI_file *midi, const Tempo_map *tmap, uint32_t sample_rate, int *status);
+int             timeline_stream_next(Timeline_stream *ts, Timed_event *out);
+int             timeline_stream_next_cmd(Timeline_stream *ts, Render_cmd *cmd);
+void            close_timeline_stream(Timeline_stream *ts);
+
+Note_list extract_note_list(const MIDI_file *midi, const Tempo_map *tmap, uint32_t sample_rate, int *status);
+void      free_note_list(Note_list *nl);
+
+Seek_index      build_seek_index(const Timeline *timeline, double interval_seconds, int *status);
+const Keyframe *seek_index_find(const Seek_index *idx, uint64_t sample);
+void            free_seek_index(Seek_index *idx);
+
+void            polyphony_scan_init(Polyphony_scan *ps, uint64_t release_samples);
+int             polyphony_scan_feed(Polyphony_scan *ps, const Render_cmd *cmd);
+Polyphony_stats polyphony_scan_finish(Polyphony_scan *ps, uint64_t end_sample);
+Polyphony_stats scan_polyphony(const Render_stream *rs, uint64_t release_samples, int *status);
+
+uint64_t timeline_end_sample(const MIDI_file *midi, const Tempo_map *tmap, uint32_t sample_rate);
+
 
 #endif /* MIDI_PREPROCESSOR_H */
@@ -5,24 +5,37 @@
 #include <stddef.h>
 
 #define SAMPLE_RATE 44100
-#define MAX_VOICES  16
+#define MAX_VOICES  256
+
+#define SYNTH_BLOCK_SIZE 256
+
+// synth_render writes interleaved left / right frames
+#define SYNTH_OUTPUT_CHANNELS 2
+
+#define SYNTH_CHANNELS 16
+#define SYNTH_KEYS     (SYNTH_CHANNELS * 128)
+
+// voices are stored and rendered in groups of this many lanes; one AVX2
+// register or two SSE registers wide
+#define SYNTH_LANES 8
+
+// oscillator shapes as (id, amplitude of harmonic h, cosine phase).
+// The wavetables are summed from these Fourier series, so a new waveform is
+// one more entry here.
+#define OSCILLATOR_TYPES(X) \
+    X(OSC_SINE,     h == 1 ? 1.0 : 0.0,                           0) \
+    X(OSC_SQUARE,   h % 2 ? 4.0 / (M_PI * h) : 0.0,               0) \
+    X(OSC_SAW,      -2.0 / (M_PI * h),                            0) \
+    X(OSC_TRIANGLE, h % 2 ? -8.0 / (M_PI * M_PI * h * h) : 0.0,   1)
 
 typedef enum
 {
-    OSC_SINE,
-    OSC_SQUARE,
-    OSC_SAW,
-    OSC_TRIANGLE
+#define X(id, partial, cosine) id,
+    OSCILLATOR_TYPES(X)
+#undef X
+    OSC_COUNT
 } Oscillator_type;
 
-typedef struct
-{
-    Oscillator_type type;
-    double          frequency;
-    double          phase;
-    double          phase_increment;
-} Oscillator;
-
 typedef enum
 {
     ENV_IDLE,
@@ -32,48 +45,350 @@ typedef enum
     ENV_RELEASE
 } Envelope_state;
 
+// LINEAR segments are straight ramps. EXPONENTIAL segments are RC curves
+// aimed past their target, so they still arrive in the segment's time
+typedef enum
+{
+    ENV_CURVE_LINEAR,
+    ENV_CURVE_EXPONENTIAL
+} Envelope_curve;
+
 typedef struct
 {
+    Envelope_curve curve;
     double attack_time;
     double decay_time;
     double sustain_level;
     double release_time;
-    
-    Envelope_state state;
-    double         current_level;
-    double         time_in_state;
 } ADSR_Envelope;
 
+typedef enum
+{
+    FILTER_LOWPASS,
+    FILTER_BANDPASS,
+    FILTER_HIGHPASS
+} Filter_response;
+
+// resonant filter on the oscillator. The cutoff tracks the voice's pitch and
+// opens with velocity and with the amplitude envelope; cutoff 0 leaves the
+// oscillator raw
+typedef struct
+{
+    double cutoff;           // in multiples of the note's frequency
+    double env_octaves;      // opened at full envelope level
+    double velocity_octaves; // opened at full velocity
+    double resonance;        // Q; 0.707 is flat
+    Filter_response response;
+} Synth_filter;
+
+typedef enum
+{
+    LFO_SINE,
+    LFO_TRIANGLE,
+    LFO_SAMPLE_HOLD
+} Lfo_shape;
+
+// a low-frequency oscillator, evaluated once per block and ramped across it.
+// The rate is in cycles per quarter note, so it follows the song's tempo;
+// each depth is what the LFO adds at the top of its swing
+typedef struct
+{
+    Lfo_shape shape;
+    double    rate;
+    double    pitch;    // cents
+    double    amp;      // fraction of the gain taken away at the bottom of the swing
+    double    pan;      // fraction of the way to either side
+    double    cutoff;   // octaves
+} Synth_lfo;
+
+typedef struct
+{
+    double   phase;     // cycles, in [0, 1)
+    float    value;     // at the end of the last block, in [-1, 1]
+    uint32_t random;    // xorshift state for LFO_SAMPLE_HOLD
+} Synth_lfo_state;
+
+// what drum sounds add to the oscillator: a fixed pitch, a pitch sweep that
+// falls onto it and white noise
+typedef struct
+{
+    double pitch;       // Hz; 0 plays the note's pitch
+    double sweep;       // factor the pitch starts above where it settles
+    double sweep_time;  // seconds for the sweep to fall by a factor e
+    double noise;       // 0 for the oscillator alone, 1 for noise alone
+} Synth_percussion;
+
+#define FM_OPERATORS 4
+
+// FM algorithms as (id, what operators 1, 2 and 3 modulate). Each is a
+// bitmask of lower operators, 0 making the operator a carrier that is heard
+// alongside operator 0. Patches with fewer operators drop the top ones
+#define FM_ALGORITHMS(X) \
+    X(FM_STACK,    0x1, 0x2, 0x4)  /* 3 > 2 > 1 > 0 */           \
+    X(FM_BRANCH,   0x1, 0x2, 0x2)  /* 2 + 3 > 1 > 0 */           \
+    X(FM_MERGE,    0x1, 0x2, 0x1)  /* 3 > 0, 2 > 1 > 0 */        \
+    X(FM_JOIN,     0x1, 0x1, 0x4)  /* 3 > 2 > 0, 1 > 0 */        \
+    X(FM_PAIRS,    0x1, 0x0, 0x4)  /* 1 > 0, 3 > 2 */            \
+    X(FM_SPREAD,   0x0, 0x0, 0x7)  /* 3 > 0, 1 and 2 */          \
+    X(FM_TRIO,     0x0, 0x0, 0x4)  /* 3 > 2, with 0 and 1 */     \
+    X(FM_ADDITIVE, 0x0, 0x0, 0x0)  /* 0, 1, 2 and 3 */
+
+typedef enum
+{
+#define X(id, op1, op2, op3) id,
+    FM_ALGORITHMS(X)
+#undef X
+    FM_ALGORITHM_COUNT
+} Fm_algorithm;
+
+// an operator's envelope runs through the voice's stages: it rises towards
+// full level in attack, settles on sustain_level in decay and sustain and
+// falls away in release, each as an RC curve with the given time constant
+typedef struct
+{
+    double attack;
+    double decay;
+    double sustain_level;
+    double release;
+} Fm_envelope;
+
+// a sine at `ratio` times the note's frequency. A modulator's level is its
+// modulation index in radians, a carrier's its gain
+typedef struct
+{
+    double      ratio;
+    double      level;
+    Fm_envelope env;
+} Synth_operator;
+
+// operator 0 is the patch's oscillator under the voice's envelope; operators
+// 1 to operators - 1 are sines read from its wavetable. The top operator may
+// feed back into its own phase
+typedef struct
+{
+    Fm_algorithm   algorithm;
+    int            operators;   // 2 to FM_OPERATORS
+    double         feedback;    // modulation index at the top operator's full level
+    Synth_operator op[FM_OPERATORS - 1];
+} Synth_fm;
+
+// what a note-on needs to start a voice; one per General MIDI family and
+// one per percussion kit sound. fm turns the oscillator into an FM voice,
+// voice_lfo runs from each note-on and channel_lfo is shared by the channel's
+// voices; any of them may be NULL
+typedef struct
+{
+    Oscillator_type  osc;
+    const Synth_fm  *fm;
+    ADSR_Envelope    env;
+    Synth_filter     filter;
+    const Synth_lfo *voice_lfo;
+    const Synth_lfo *channel_lfo;
+    Synth_percussion percussion;
+} Synth_patch;
+
+typedef struct
+{
+    const Synth_patch *patch;
+    uint8_t  program;
+    uint8_t  volume;
+    uint8_t  expression;
+    uint8_t  pan;
+    // CC7 and CC11 folded into one gain, applied to the channel's voices
+    float    gain;
+    // CC10 as constant-power gains, taken by voices at note-on
+    float    pan_angle;
+    float    pan_left;
+    float    pan_right;
+    // 0 for no limit beyond the pool
+    size_t   voice_limit;
+    size_t   voice_count;
+    uint16_t pitch_bend;
+    uint8_t  modulation;
+    // registered parameter selected by CC101 / CC100
+    uint8_t  rpn_msb;
+    uint8_t  rpn_lsb;
+    // RPN 0, the bend range
+    uint8_t  bend_semitones;
+    uint8_t  bend_cents;
+    // pitch factor reached at the end of the last block, and whether its
+    // voices are still gliding towards it
+    double   pitch_ratio;
+    int      gliding;
+    Synth_lfo_state lfo;
+} Synth_channel;
+
+typedef enum
+{
+    SYNTH_ISA_SCALAR,
+    SYNTH_ISA_SSE2,
+    SYNTH_ISA_AVX2
+} Synth_isa;
+
+// cold per-voice data, only touched on events and segment changes
 typedef struct
 {
+    uint8_t        channel;
     uint8_t        midi_note;
     uint8_t        velocity;
     uint8_t        active;
-    
-    Oscillator     osc;
+    // velocity gain and constant-power pan, scaled by the channel gain into
+    // Voice_bank.gain_left / gain_right
+    float          note_gain;
+    float          pan_angle;
+    float          pan_left;
+    float          pan_right;
+    Oscillator_type osc;
+    const Synth_fm *fm;
+    // phase increment of the unbent note, in cycles per sample
+    double         base_inc;
+    // factor the percussion pitch sweep starts at, 1 once it has settled,
+    // and its time constant
+    double         sweep;
+    double         sweep_samples;
+    // set while the key is down; the voice is then linked into the list of
+    // its (channel, note) in Synth.held
+    uint8_t        held;
+    int32_t        key_prev;
+    int32_t        key_next;
+    // position in Synth.active while active
+    uint32_t       slot;
+    // Synth.clock at note-on
+    uint64_t       started;
+    Envelope_state state;
     ADSR_Envelope  env;
+    Synth_filter   filter;
+    // what the filter coefficients were last worked out from, so voices
+    // holding still skip the work
+    float          filter_octaves;
+    uint32_t       filter_inc;
+    const Synth_lfo *lfo;
+    Synth_lfo_state lfo_state;
 } Voice;
 
+// hot per-sample voice state as struct-of-arrays, one 32-bit lane per voice.
+// Phase is a DDS accumulator: a full cycle is 2^32, wraparound is integer
+// overflow and the top WAVETABLE_BITS bits index the table. While a pitch
+// moves, phase_inc itself steps by phase_glide every sample, and while an LFO
+// moves the gains they step by gain_left_glide / gain_right_glide.
+// Within a segment the envelope follows level = level * env_mul + env_add,
+// env_mul being 1 for linear ramps, and env_left counts the samples until
+// the next segment starts.
+// The filter is a TPT state-variable filter with integrator states svf_ic1
+// and svf_ic2. Its coefficients svf_a1..a3 are worked out per block and step
+// by svf_d1..d3 every sample; its output is svf_dry * input + svf_band * band
+// + svf_low * low, which is the input alone for unfiltered lanes.
+// noise is each lane's xorshift state and noise_mix how much of it replaces
+// the oscillator.
+// FM operators 1 to FM_OPERATORS - 1 keep their own phase, increment and
+// glide, and an envelope following op_level = op_level * op_mul + op_add.
+// op_mod[s - 1][t] weighs operator s's output into operator t's phase (t < s),
+// op_feedback its previous output op_out into its own, and op_carrier how much
+// of it is heard. Lanes without FM have all of these at 0.
 typedef struct
 {
-    Voice  voices[MAX_VOICES];
-    double master_volume;
-} Synth;
+    uint32_t *phase;
+    uint32_t *phase_inc;
+    uint32_t *phase_glide;
+    float  *gain_left;
+    float  *gain_right;
+    float  *gain_left_glide;
+    float  *gain_right_glide;
+    float  *level;
+    float  *env_mul;
+    float  *env_add;
+    uint32_t *env_left;
+    float  *svf_ic1;
+    float  *svf_ic2;
+    float  *svf_a1;
+    float  *svf_a2;
+    float  *svf_a3;
+    float  *svf_d1;
+    float  *svf_d2;
+    float  *svf_d3;
+    float  *svf_dry;
+    float  *svf_band;
+    float  *svf_low;
+    uint32_t *noise;
+    float  *noise_mix;
+    uint32_t *op_phase[FM_OPERATORS - 1];
+    uint32_t *op_inc[FM_OPERATORS - 1];
+    uint32_t *op_glide[FM_OPERATORS - 1];
+    float  *op_level[FM_OPERATORS - 1];
+    float  *op_mul[FM_OPERATORS - 1];
+    float  *op_add[FM_OPERATORS - 1];
+    float  *op_mod[FM_OPERATORS - 1][FM_OPERATORS - 1];
+    float  *op_feedback[FM_OPERATORS - 1];
+    float  *op_out[FM_OPERATORS - 1];
+    float  *op_carrier[FM_OPERATORS - 1];
+    // offset of the lane's table in wavetables
+    int32_t *table;
+    
+    const float *wavetables;
+    // offset of the sine in wavetables, which every FM operator reads
+    int32_t sine_table;
+    // per-lane partial sums of the block being rendered; each frame holds
+    // SYNTH_LANES left sums, then SYNTH_LANES right sums
+    float  *lane_mix;
+    
+    Voice  *voices;
+    size_t  capacity;
+    void   *storage;
+} Voice_bank;
 
-void oscillator_init(Oscillator *osc, Oscillator_type type, double frequency);
-void oscillator_set_frequency(Oscillator *osc, double frequency);
-float oscillator_next_sample(Oscillator *osc);
+typedef void (*Voice_kernel_fn)(Voice_bank *bank, size_t first, float *lane_mix, size_t frame_count);
+typedef void (*Voice_mix_fn)(const float *lane_mix, float *out, size_t frame_count, float master);
 
-void envelope_init(ADSR_Envelope *env, double attack, double decay, double sustain, double release);
-void envelope_trigger(ADSR_Envelope *env);
-void envelope_release(ADSR_Envelope *env);
-float envelope_next_value(ADSR_Envelope *env, double sample_rate);
+typedef struct
+{
+    Voice_bank       bank;
+    size_t           voice_count;
+    // compact lists of the sounding voices and of the lane groups holding
+    // them, so quiet passages only cost what they play
+    uint32_t        *active;
+    size_t           active_count;
+    uint32_t        *live_groups;
+    size_t           live_group_count;
+    uint8_t         *group_voices;
+    // idle voices, taken from the top
+    uint32_t        *free_voices;
+    size_t           free_count;
+    // first held voice of each (channel, note), -1 if none
+    int32_t          held[SYNTH_KEYS];
+    // samples and quarter notes into the song; the channel LFOs and the
+    // mod wheel vibrato are worked out from these rather than stepped, so
+    // a render started part way in finds them where the full render has them
+    uint64_t         clock;
+    double           beat;
+    // the song's tempo, in quarter notes per sample
+    double           beats_per_sample;
+    Synth_channel    channels[SYNTH_CHANNELS];
+    double           master_volume;
+    Synth_isa        isa;
+    const Voice_kernel_fn *kernels;
+    Voice_mix_fn     mixdown;
+} Synth;
 
-void synth_init(Synth *synth);
-void synth_note_on(Synth *synth, uint8_t note, uint8_t velocity);
-void synth_note_off(Synth *synth, uint8_t note);
+int  synth_init(Synth *synth, size_t voice_count);
+void synth_free(Synth *synth);
+Synth_isa synth_detect_isa(void);
+int  synth_set_isa(Synth *synth, Synth_isa isa);
+const char *synth_isa_name(Synth_isa isa);
+double synth_max_release_time(void);
+void synth_note_on(Synth *synth, uint8_t channel, uint8_t note, uint8_t velocity);
+void synth_resume_note(Synth *synth, uint8_t channel, uint8_t note, uint8_t velocity, uint64_t age_samples);
+void synth_note_off(Synth *synth, uint8_t channel, uint8_t note);
+void synth_program_change(Synth *synth, uint8_t channel, uint8_t program);
+void synth_control_change(Synth *synth, uint8_t channel, uint8_t controller, uint8_t value);
+void synth_pitch_bend(Synth *synth, uint8_t channel, uint16_t bend);
+void synth_set_bend_range(Synth *synth, uint8_t channel, uint8_t semitones, uint8_t cents);
+void synth_set_voice_limit(Synth *synth, uint8_t channel, size_t limit);
+void synth_set_tempo(Synth *synth, uint32_t us_per_qn);
+void synth_set_clock(Synth *synth, uint64_t sample, double beat);
 void synth_render(Synth *synth, float *buffer, size_t frame_count);
 
+void voice_bank_end_segment(Voice_bank *bank, size_t v);
+
 double midi_note_to_frequency(uint8_t note);
 
 #endif /* SYNTH_H */
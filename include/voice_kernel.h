@@ -0,0 +1,58 @@
+#ifndef VOICE_KERNEL_H
+#define VOICE_KERNEL_H
+
+#include "synth.h"
+
+// kernel variants, picked per lane group and block by what the group's
+// voices are doing. Each is a separate instantiation of src/voice_kernel.inc
+// with the mode fixed at compile time; a mode is a set of these features:
+//   VK_ENVELOPE: some lane is in attack, decay or release
+//   VK_GLIDE:    some lane's pitch or gains are moving; phase_inc and the
+//                gains step every sample
+//   VK_FILTER:   some lane runs its oscillator through the state-variable filter
+//   VK_NOISE:    some lane blends white noise into its oscillator
+//   VK_FM:       some lane is an FM voice; its operators modulate the
+//                oscillator's phase and add to it
+// Without them levels, pitches and gains are constant across the block and the
+// oscillators are heard raw.
+enum
+{
+    VK_ENVELOPE = 1,
+    VK_GLIDE    = 2,
+    VK_FILTER   = 4,
+    VK_NOISE    = 8,
+    VK_FM       = 16
+};
+
+typedef int Voice_kernel_mode;
+
+#define VK_MODE_COUNT ((VK_ENVELOPE | VK_GLIDE | VK_FILTER | VK_NOISE | VK_FM) + 1)
+
+// every set of features gets its own kernel
+#define VOICE_KERNEL_MODES(X)                                           \
+    X(0)  X(1)  X(2)  X(3)  X(4)  X(5)  X(6)  X(7)                      \
+    X(8)  X(9)  X(10) X(11) X(12) X(13) X(14) X(15)                     \
+    X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23)                     \
+    X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31)
+
+// FM modulation reaches the kernels as phase offsets in 2^-FM_PHASE_BITS
+// cycles; the routing weights in Voice_bank carry the scale, so an operator
+// output of 1 through a weight of FM_INDEX_SCALE is a modulation index of one
+// radian
+#define FM_PHASE_BITS  24
+#define FM_INDEX_SCALE ((double)(1 << FM_PHASE_BITS) / (2.0 * 3.14159265358979323846))
+
+// one build of src/voice_kernel.inc per instruction set; each kernel renders
+// the SYNTH_LANES voices starting at `first` and adds lane l of frame i into
+// lane_mix[(2 * i) * SYNTH_LANES + l] for the left side and the next row for
+// the right. The mixdown folds every frame's lanes, applies the master
+// volume and writes interleaved, clamped stereo. All builds use the same
+// operation order, so their output is bit-identical.
+extern const Voice_kernel_fn voice_kernels_scalar[VK_MODE_COUNT];
+extern const Voice_kernel_fn voice_kernels_sse2[VK_MODE_COUNT];
+extern const Voice_kernel_fn voice_kernels_avx2[VK_MODE_COUNT];
+void voice_mixdown_scalar(const float *lane_mix, float *out, size_t frame_count, float master);
+void voice_mixdown_sse2(const float *lane_mix, float *out, size_t frame_count, float master);
+void voice_mixdown_avx2(const float *lane_mix, float *out, size_t frame_count, float master);
+
+#endif /* VOICE_KERNEL_H */
@@ -0,0 +1,19 @@
+#ifndef WAVETABLE_H
+#define WAVETABLE_H
+
+#include <stdint.h>
+#include "synth.h"
+
+#define WAVETABLE_BITS   11
+#define WAVETABLE_SIZE   (1 << WAVETABLE_BITS)
+// one guard sample repeats the first so interpolation never has to wrap
+#define WAVETABLE_STRIDE (WAVETABLE_SIZE + 1)
+// band-limited copies per shape, one per octave
+#define WAVETABLE_LEVELS (WAVETABLE_BITS)
+
+int  wavetables_init(const char *cache_path);
+void wavetables_free(void);
+const float *wavetables_data(void);
+int32_t wavetable_offset(Oscillator_type type, double phase_increment);
+
+#endif /* WAVETABLE_H */
@@ -5,18 +5,173 @@
 #include "include/json_generator.h"
 #include "include/midi_preprocessor.h"
 #include "include/synth.h"
+#include "include/wavetable.h"
 
 #define MINIAUDIO_IMPLEMENTATION
 #include "include/miniaudio.h"
 
+#define RENDER_CHUNK_FRAMES   4096
+#define SEEK_INTERVAL_SECONDS 5.0
+
+typedef int (*Next_cmd_fn)(void *src, Render_cmd *cmd);
+
+typedef struct
+{
+    const Render_cmd *cmd;
+    const Render_cmd *end;
+} Cmd_array_source;
+
 static void print_usage(const char *prog)
 {
-    printf("Usage: %s <input.mid> [-o output.json] [-a output.wav]\n", prog);
+    printf("Usage: %s <input.mid> [-o output.json] [-a output.wav] [-s] [-t seconds] [-v voices] [-c voices] [-w cache]\n", prog);
     printf("  -o : Parse MIDI and write to JSON file\n");
     printf("  -a : Generate audio WAV file from MIDI\n");
+    printf("  -s : Stream events while rendering instead of building the whole timeline\n");
+    printf("  -t : Start the audio at the given time in seconds\n");
+    printf("  -v : Cap the voice pool sized from the song's polyphony (default %d)\n", MAX_VOICES);
+    printf("  -c : Cap the voices any one MIDI channel may hold\n");
+    printf("  -w : Load the oscillator wavetables from this cache file, creating it if needed\n");
     printf("  At least one option (-o or -a) must be specified\n");
 }
 
+static int next_array_cmd(void *src, Render_cmd *cmd)
+{
+    Cmd_array_source *as = (Cmd_array_source*)src;
+    if (as->cmd == as->end) return 0;
+    *cmd = *as->cmd++;
+    return 1;
+}
+
+static int next_stream_cmd(void *src, Render_cmd *cmd)
+{
+    return timeline_stream_next_cmd((Timeline_stream*)src, cmd);
+}
+
+static void apply_render_cmd(Synth *synth, const Render_cmd *cmd)
+{
+    switch (cmd->op)
+    {
+    case RC_NOTE_ON:
+        synth_note_on(synth, cmd->channel, cmd->note, cmd->value);
+        break;
+    case RC_NOTE_OFF:
+        synth_note_off(synth, cmd->channel, cmd->note);
+        break;
+    case RC_PROGRAM:
+        synth_program_change(synth, cmd->channel, cmd->value);
+        break;
+    case RC_CONTROL:
+        synth_control_change(synth, cmd->channel, cmd->note, cmd->value);
+        break;
+    case RC_PITCH_BEND:
+        synth_pitch_bend(synth, cmd->channel, (uint16_t)(cmd->note | (cmd->value << 7)));
+        break;
+    case RC_TEMPO:
+        synth_set_tempo(synth, render_cmd_tempo(cmd));
+        break;
+    }
+}
+
+static void restore_keyframe(Synth *synth, const Seek_index *idx, const Keyframe *kf)
+{
+    static const uint8_t restored[] = { 1, 7, 10, 11 };
+    synth_set_tempo(synth, kf->us_per_qn);
+    for (uint8_t ch = 0; ch < 16; ++ch)
+    {
+        synth_program_change(synth, ch, kf->program[ch]);
+        for (size_t c = 0; c < sizeof(restored); ++c)
+            synth_control_change(synth, ch, restored[c], kf->controllers[ch][restored[c]]);
+        synth_set_bend_range(synth, ch, kf->bend_semitones[ch], kf->bend_cents[ch]);
+        synth_control_change(synth, ch, 101, kf->rpn_msb[ch]);
+        synth_control_change(synth, ch, 100, kf->rpn_lsb[ch]);
+        synth_pitch_bend(synth, ch, kf->pitch_bend[ch]);
+    }
+    synth_set_clock(synth, kf->sample, kf->beat);
+
+    for (size_t k = 0; k < kf->note_count; ++k)
+    {
+        const Held_note *hn = &idx->notes[kf->first_note + k];
+        synth_resume_note(synth, hn->channel, hn->note, hn->velocity, kf->sample - hn->start_sample);
+    }
+}
+
+// Renders from `from_sample` on; audio before `start_sample` is only
+// simulated to bring the synth up to date and is not written.
+static int render_to_encoder(Synth *synth, ma_encoder *encoder, Next_cmd_fn next_cmd, void *src,
+                             uint64_t from_sample, uint64_t start_sample, uint64_t total_samples)
+{
+    static float chunk[RENDER_CHUNK_FRAMES * SYNTH_OUTPUT_CHANNELS];
+    size_t filled = 0;
+
+    Render_cmd cmd;
+    int have_cmd = next_cmd(src, &cmd);
+    uint64_t progress_step = SAMPLE_RATE * 2;
+    uint64_t next_progress = 0;
+
+    for (uint64_t i = from_sample; i < total_samples; )
+    {
+        while (have_cmd && cmd.sample <= i)
+        {
+            apply_render_cmd(synth, &cmd);
+            have_cmd = next_cmd(src, &cmd);
+        }
+
+        // render straight up to the next event boundary
+        uint64_t next = total_samples;
+        if (have_cmd && cmd.sample < next)
+            next = cmd.sample;
+
+        // pieces end on whole chunks of song time, so the synth updates its
+        // LFOs, glides and filters at the same samples whatever the start
+        while (i < next)
+        {
+            size_t n = RENDER_CHUNK_FRAMES - (size_t)(i % RENDER_CHUNK_FRAMES);
+            if (n > next - i) n = (size_t)(next - i);
+            if (filled + n > RENDER_CHUNK_FRAMES)
+            {
+                if (ma_encoder_write_pcm_frames(encoder, chunk, filled, NULL) != MA_SUCCESS) return 0;
+                filled = 0;
+            }
+
+            synth_render(synth, &chunk[filled * SYNTH_OUTPUT_CHANNELS], n);
+            if (i + n <= start_sample)
+            {
+                i += n;
+                continue;
+            }
+            if (i < start_sample)
+            {
+                // keep the part of the piece from the start on
+                size_t skip = (size_t)(start_sample - i);
+                memmove(chunk, &chunk[skip * SYNTH_OUTPUT_CHANNELS], (n - skip) * SYNTH_OUTPUT_CHANNELS * sizeof(float));
+                filled = n - skip;
+            }
+            else
+            {
+                filled += n;
+            }
+            i += n;
+
+            if (filled == RENDER_CHUNK_FRAMES)
+            {
+                if (ma_encoder_write_pcm_frames(encoder, chunk, filled, NULL) != MA_SUCCESS) return 0;
+                filled = 0;
+            }
+        }
+
+        if (i >= start_sample && i >= next_progress)
+        {
+            printf("\rRendering: %.1f%%", ((i - start_sample) * 100.0) / (total_samples - start_sample));
+            fflush(stdout);
+            next_progress = i + progress_step;
+        }
+    }
+
+    if (filled > 0 && ma_encoder_write_pcm_frames(encoder, chunk, filled, NULL) != MA_SUCCESS) return 0;
+    printf("\rRendering: 100.0%%\n");
+    return 1;
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 3)
@@ -28,6 +183,11 @@ int main(int argc, char **argv)
     char *input_file = argv[1];
     char *json_output = NULL;
     char *audio_output = NULL;
+    int streaming = 0;
+    double start_seconds = 0.0;
+    size_t max_voices = MAX_VOICES;
+    size_t channel_voices = 0;
+    char *wavetable_cache = NULL;
 
     for (int i = 2; i < argc; i++)
     {
@@ -39,6 +199,29 @@ int main(int argc, char **argv)
         {
             audio_output = argv[++i];
         }
+        else if (strcmp(argv[i], "-s") == 0)
+        {
+            streaming = 1;
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            start_seconds = atof(argv[++i]);
+            if (start_seconds < 0.0) start_seconds = 0.0;
+        }
+        else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc)
+        {
+            int v = atoi(argv[++i]);
+            max_voices = v > 0 ? (size_t)v : 1;
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            int v = atoi(argv[++i]);
+            channel_voices = v > 0 ? (size_t)v : 1;
+        }
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+        {
+            wavetable_cache = argv[++i];
+        }
         else
         {
             print_usage(argv[0]);
@@ -91,103 +274,181 @@ int main(int argc, char **argv)
             return 1;
         }
 
-        Timeline timeline = merge_tracks_to_timeline(&midi, &tmap, &status);
-        if (status != 0)
+        Render_stream rstream = { 0 };
+        Timeline_stream tstream = { 0 };
+        Seek_index seek_idx = { 0 };
+        const Keyframe *keyframe = NULL;
+        Cmd_array_source array_src;
+        Next_cmd_fn next_cmd;
+        void *src;
+        uint64_t end_sample;
+        uint64_t start_sample = (uint64_t)(start_seconds * SAMPLE_RATE);
+        uint64_t release_samples = (uint64_t)(synth_max_release_time() * SAMPLE_RATE);
+        Polyphony_stats polyphony = { 0 };
+
+        if (streaming)
+        {
+            tstream = open_timeline_stream(&midi, &tmap, SAMPLE_RATE, &status);
+            if (status != 0)
+            {
+                printf("Error: Failed to open timeline stream\n");
+                free_tempo_map(&tmap);
+                free_MIDI_file(&midi);
+                return 1;
+            }
+            if (tstream.heap_count == 0)
+            {
+                printf("Error: No events to process\n");
+                close_timeline_stream(&tstream);
+                free_tempo_map(&tmap);
+                free_MIDI_file(&midi);
+                return 1;
+            }
+            end_sample = timeline_end_sample(&midi, &tmap, SAMPLE_RATE);
+
+            // a second stream pre-scans the polyphony without materialising anything
+            Timeline_stream scan_stream = open_timeline_stream(&midi, &tmap, SAMPLE_RATE, &status);
+            if (status == 0)
+            {
+                Polyphony_scan ps;
+                Render_cmd cmd;
+                polyphony_scan_init(&ps, release_samples);
+                while (status == 0 && timeline_stream_next_cmd(&scan_stream, &cmd))
+                {
+                    if (!polyphony_scan_feed(&ps, &cmd)) status = -1;
+                }
+                polyphony = polyphony_scan_finish(&ps, end_sample + release_samples);
+                close_timeline_stream(&scan_stream);
+            }
+            if (status != 0)
+            {
+                printf("Error: Failed to scan polyphony\n");
+                close_timeline_stream(&tstream);
+                free_tempo_map(&tmap);
+                free_MIDI_file(&midi);
+                return 1;
+            }
+            next_cmd = next_stream_cmd;
+            src = &tstream;
+        }
+        else
         {
-            printf("Error: Failed to merge tracks\n");
+            Timeline timeline = merge_tracks_to_timeline_parallel(&midi, &tmap, SAMPLE_RATE, 0, &status);
+            if (status != 0)
+            {
+                printf("Error: Failed to merge tracks\n");
+                free_tempo_map(&tmap);
+                free_MIDI_file(&midi);
+                return 1;
+            }
+
+            if (timeline.count == 0)
+            {
+                printf("Error: No events to process\n");
+                free_timeline(&timeline);
+                free_tempo_map(&tmap);
+                free_MIDI_file(&midi);
+                return 1;
+            }
+
+            rstream = build_render_stream(&timeline, &status);
+            if (status == 0)
+                polyphony = scan_polyphony(&rstream, release_samples, &status);
+            if (status == 0 && start_sample > 0)
+            {
+                seek_idx = build_seek_index(&timeline, SEEK_INTERVAL_SECONDS, &status);
+                // start early enough that notes released just before the
+                // start time are still heard fading out
+                uint64_t restore = start_sample > release_samples ? start_sample - release_samples : 0;
+                keyframe = seek_index_find(&seek_idx, restore);
+            }
+            free_timeline(&timeline);
+            if (status != 0)
+            {
+                printf("Error: Failed to build render stream\n");
+                free_render_stream(&rstream);
+                free_tempo_map(&tmap);
+                free_MIDI_file(&midi);
+                return 1;
+            }
+            end_sample = rstream.end_sample;
+            array_src.cmd = rstream.cmds + (keyframe ? keyframe->stream_pos : 0);
+            array_src.end = rstream.cmds + rstream.count;
+            next_cmd = next_array_cmd;
+            src = &array_src;
+        }
+
+        uint64_t total_samples = end_sample + SAMPLE_RATE;
+        if (start_sample >= total_samples)
+        {
+            printf("Error: Start time is past the end of the song\n");
+            free_seek_index(&seek_idx);
+            close_timeline_stream(&tstream);
+            free_render_stream(&rstream);
             free_tempo_map(&tmap);
             free_MIDI_file(&midi);
             return 1;
         }
+        double duration_ms = (double)(total_samples - start_sample) * 1000.0 / SAMPLE_RATE;
+
+        ma_encoder_config config = ma_encoder_config_init(ma_encoding_format_wav, ma_format_f32, SYNTH_OUTPUT_CHANNELS, SAMPLE_RATE);
+        ma_encoder encoder;
 
-        if (timeline.count == 0)
+        if (ma_encoder_init_file(audio_output, &config, &encoder) != MA_SUCCESS)
         {
-            printf("Error: No events to process\n");
-            free_timeline(&timeline);
+            printf("Error: Failed to initialize audio encoder\n");
+            free_seek_index(&seek_idx);
+            close_timeline_stream(&tstream);
+            free_render_stream(&rstream);
             free_tempo_map(&tmap);
             free_MIDI_file(&midi);
             return 1;
         }
 
-        double duration_ms = timeline.events[timeline.count - 1].timestamp_ms + 1000.0;
-        size_t total_samples = (size_t)((duration_ms / 1000.0) * SAMPLE_RATE);
-        
-        float *audio_buffer = (float*)malloc(total_samples * sizeof(float));
-        if (!audio_buffer)
+        size_t voice_count = polyphony.peak < max_voices ? polyphony.peak : max_voices;
+        printf("Polyphony: peak %u, average %.2f (%zu voices)\n", polyphony.peak, polyphony.average, voice_count);
+
+        Synth synth;
+        if (!wavetables_init(wavetable_cache) || !synth_init(&synth, voice_count))
         {
-            printf("Error: Failed to allocate audio buffer\n");
-            free_timeline(&timeline);
+            printf("Error: Failed to allocate voices\n");
+            wavetables_free();
+            ma_encoder_uninit(&encoder);
+            free_seek_index(&seek_idx);
+            close_timeline_stream(&tstream);
+            free_render_stream(&rstream);
             free_tempo_map(&tmap);
             free_MIDI_file(&midi);
             return 1;
         }
 
-        Synth synth;
-        synth_init(&synth);
-
-        size_t event_idx = 0;
-        double current_time_ms = 0.0;
-        double ms_per_sample = 1000.0 / SAMPLE_RATE;
+        for (uint8_t ch = 0; ch < 16; ++ch)
+            synth_set_voice_limit(&synth, ch, channel_voices);
 
-        for (size_t i = 0; i < total_samples; ++i)
+        uint64_t from_sample = 0;
+        if (keyframe)
         {
-            while (event_idx < timeline.count && timeline.events[event_idx].timestamp_ms <= current_time_ms)
-            {
-                Timed_event *te = &timeline.events[event_idx];
-                MTrk_event *ev = te->event;
-
-                if (ev->kind == CH)
-                {
-                    uint8_t type = ev->channel_ev.type;
-                    uint8_t note = ev->channel_ev.param1;
-                    uint8_t velocity = ev->channel_ev.param2;
-
-                    if (type == 0x9 && velocity > 0)
-                    {
-                        synth_note_on(&synth, note, velocity);
-                    }
-                    else if (type == 0x8 || (type == 0x9 && velocity == 0))
-                    {
-                        synth_note_off(&synth, note);
-                    }
-                }
-
-                event_idx++;
-            }
-
-            synth_render(&synth, &audio_buffer[i], 1);
-            current_time_ms += ms_per_sample;
-
-            if (i % (SAMPLE_RATE * 2) == 0 || i == total_samples - 1)
-            {
-                printf("\rRendering: %.1f%%", (i * 100.0) / total_samples);
-                fflush(stdout);
-            }
+            restore_keyframe(&synth, &seek_idx, keyframe);
+            from_sample = keyframe->sample;
         }
-        printf("\rRendering: 100.0%%\n");
 
-        ma_encoder_config config = ma_encoder_config_init(ma_encoding_format_wav, ma_format_f32, 1, SAMPLE_RATE);
-        ma_encoder encoder;
+        int rendered = render_to_encoder(&synth, &encoder, next_cmd, src, from_sample, start_sample, total_samples);
+        ma_encoder_uninit(&encoder);
+        synth_free(&synth);
+        wavetables_free();
 
-        if (ma_encoder_init_file(audio_output, &config, &encoder) != MA_SUCCESS)
+        free_seek_index(&seek_idx);
+        close_timeline_stream(&tstream);
+        free_render_stream(&rstream);
+        free_tempo_map(&tmap);
+
+        if (!rendered)
         {
-            printf("Error: Failed to initialize audio encoder\n");
-            free(audio_buffer);
-            free_timeline(&timeline);
-            free_tempo_map(&tmap);
+            printf("\nError: Failed to write audio file\n");
             free_MIDI_file(&midi);
             return 1;
         }
-
-        ma_uint64 frames_written = 0;
-        ma_encoder_write_pcm_frames(&encoder, audio_buffer, total_samples, &frames_written);
-        ma_encoder_uninit(&encoder);
-
         printf("Generated audio: %s (%.2f seconds)\n", audio_output, duration_ms / 1000.0);
-
-        free(audio_buffer);
-        free_timeline(&timeline);
-        free_tempo_map(&tmap);
     }
 
     free_MIDI_file(&midi);
@@ -1,5 +1,13 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "midi_preprocessor.h"
 
 
@@ -27,15 +35,44 @@ static inline int tempo_map_ensure_one(Tempo_map *tmap)
     return tempo_map_grow(tmap, tmap->count + 1);
 }
 
+// ties are broken by track and event position so the tempo in force at
+// a tick does not depend on the sort
 static int compare_tempo_tick(const void *a, const void *b)
 {
     const Tempo_change *ta = (const Tempo_change*)a;
     const Tempo_change *tb = (const Tempo_change*)b;
     if (ta->tick < tb->tick) return -1;
     if (ta->tick > tb->tick) return  1;
+    if (ta->track_idx != tb->track_idx) return ta->track_idx < tb->track_idx ? -1 : 1;
+    if (ta->event_idx != tb->event_idx) return ta->event_idx < tb->event_idx ? -1 : 1;
     return 0;
 }
 
+static int tempo_change_from_event(const MTrk_event *ev, uint64_t tick, uint16_t track_idx, size_t event_idx,
+                                   Tempo_change *tchange)
+{
+    if (ev->kind != META || ev->meta_ev.type != 0x51) return 0;
+
+    uint8_t *data = (uint8_t*)ev->meta_ev.data;
+    uint32_t us_per_qn = (data[0] << 16) | (data[1] << 8) | data[2];
+
+    tchange->tick      = tick;
+    tchange->us_per_qn = us_per_qn;
+    tchange->bpm       = 60000000.0 / us_per_qn;
+    tchange->track_idx = track_idx;
+    tchange->event_idx = event_idx;
+    return 1;
+}
+
+static void tempo_change_default(Tempo_change *tchange)
+{
+    tchange->tick      = 0;
+    tchange->us_per_qn = 500000;
+    tchange->bpm       = 120.0;
+    tchange->track_idx = TEMPO_DEFAULT_TRACK;
+    tchange->event_idx = 0;
+}
+
 Tempo_map build_tempo_map(const MIDI_file *midi, int *status)
 {
     uint32_t ntracks = midi->mthd.ntracks;
@@ -49,17 +86,10 @@ Tempo_map build_tempo_map(const MIDI_file *midi, int *status)
         {
             MTrk_event curr_ev = curr_track.events[k];
             cum_delta += curr_ev.delta_time;
-            if (curr_ev.kind == META && curr_ev.meta_ev.type == 0x51)
+
+            Tempo_change tchange;
+            if (tempo_change_from_event(&curr_ev, cum_delta, (uint16_t)i, k, &tchange))
             {
-                uint8_t *data = (uint8_t*)curr_ev.meta_ev.data;
-                uint32_t us_per_qn = (data[0] << 16) | (data[1] << 8) | data[2];
-                double bpm = 60000000.0 / us_per_qn;
-
-                Tempo_change tchange;
-                tchange.tick      = cum_delta;
-                tchange.us_per_qn = us_per_qn;
-                tchange.bpm       = bpm;
-                
                 if (!tempo_map_ensure_one(&tmap))
                 {
                     *status = -1;
@@ -78,12 +108,7 @@ Tempo_map build_tempo_map(const MIDI_file *midi, int *status)
             *status = -1;
             return (Tempo_map){ 0 };
         }
-        Tempo_change default_tempo;
-        default_tempo.tick      = 0;
-        default_tempo.us_per_qn = 500000;
-        default_tempo.bpm       = 120.0;
-
-        tmap.changes[tmap.count++] = default_tempo;
+        tempo_change_default(&tmap.changes[tmap.count++]);
     }
 
     qsort(tmap.changes, tmap.count, sizeof(Tempo_change), compare_tempo_tick);
@@ -151,6 +176,64 @@ double tick_to_milliseconds(uint64_t tick, const MThd *mthd, const Tempo_map *tm
     }
 }
 
+// Exact tick -> sample conversion. Elapsed time is kept as a rational
+// number num / den seconds: for metrical files num accumulates
+// delta_ticks * us_per_qn and den is ticks_per_beat * 10^6, for SMPTE
+// files num is the tick itself and den is frames_per_sec * ticks_per_frame.
+static void tick_clock_init(Tick_clock *clk, const MThd *mthd, const Tempo_map *tmap, uint32_t sample_rate)
+{
+    clk->tmap        = tmap;
+    clk->sample_rate = sample_rate;
+    clk->is_fps      = mthd->is_fps;
+    clk->next_change = 0;
+    clk->seg_tick    = 0;
+    clk->seg_num     = 0;
+    clk->us_per_qn   = tmap->count ? tmap->changes[0].us_per_qn : 500000;
+
+    if (mthd->is_fps)
+        clk->den = (uint64_t)(-mthd->timediv.frames_per_sec.smpte) * mthd->timediv.frames_per_sec.ticks;
+    else
+        clk->den = (uint64_t)mthd->timediv.ticks_per_beat * 1000000u;
+}
+
+// ticks must be queried in non-decreasing order
+static uint64_t tick_clock_numerator(Tick_clock *clk, uint64_t tick)
+{
+    if (clk->is_fps) return tick;
+
+    const Tempo_map *tmap = clk->tmap;
+    while (clk->next_change < tmap->count && tmap->changes[clk->next_change].tick < tick)
+    {
+        const Tempo_change *tc = &tmap->changes[clk->next_change];
+        clk->seg_num  += (tc->tick - clk->seg_tick) * clk->us_per_qn;
+        clk->seg_tick  = tc->tick;
+        clk->us_per_qn = tc->us_per_qn;
+        clk->next_change++;
+    }
+    return clk->seg_num + (tick - clk->seg_tick) * clk->us_per_qn;
+}
+
+// first output sample at or after the event time
+static inline uint64_t tick_clock_samples(const Tick_clock *clk, uint64_t num)
+{
+    if (clk->den == 0) return 0;
+    uint64_t rem = (num % clk->den) * clk->sample_rate;
+    return (num / clk->den) * clk->sample_rate + (rem + clk->den - 1) / clk->den;
+}
+
+static inline double tick_clock_milliseconds(const Tick_clock *clk, uint64_t num)
+{
+    if (clk->den == 0) return 0.0;
+    return (double)num * 1000.0 / (double)clk->den;
+}
+
+uint64_t tick_to_sample(uint64_t tick, const MThd *mthd, const Tempo_map *tmap, uint32_t sample_rate)
+{
+    Tick_clock clk;
+    tick_clock_init(&clk, mthd, tmap, sample_rate);
+    return tick_clock_samples(&clk, tick_clock_numerator(&clk, tick));
+}
+
 static int timeline_grow(Timeline *tl, size_t min_needed)
 {
     size_t cap = tl->cap ? tl->cap : 256;
@@ -169,54 +252,263 @@ static int timeline_grow(Timeline *tl, size_t min_needed)
     return 1;
 }
 
-static inline int timeline_ensure_one(Timeline *tl)
+// the stream keeps one cursor per track and a min-heap of track indices
+// ordered like the batch timeline: by tick, then by track
+static inline int stream_cursor_less(const Timeline_stream *ts, uint16_t a, uint16_t b)
 {
-    if (tl->count < tl->cap) return 1;
-    return timeline_grow(tl, tl->count + 1);
+    uint64_t ta = ts->cursors[a].tick;
+    uint64_t tb = ts->cursors[b].tick;
+    if (ta != tb) return ta < tb;
+    return a < b;
 }
 
-static int compare_timed_event(const void *a, const void *b)
+static void stream_sift_down(Timeline_stream *ts, size_t i)
 {
-    const Timed_event *ta = (const Timed_event*)a;
-    const Timed_event *tb = (const Timed_event*)b;
-    if (ta->timestamp_ms < tb->timestamp_ms) return -1;
-    if (ta->timestamp_ms > tb->timestamp_ms) return 1;
-    return 0;
+    uint16_t *heap = ts->heap;
+    size_t n = ts->heap_count;
+    for (;;)
+    {
+        size_t l = 2 * i + 1;
+        size_t r = l + 1;
+        size_t min = i;
+        if (l < n && stream_cursor_less(ts, heap[l], heap[min])) min = l;
+        if (r < n && stream_cursor_less(ts, heap[r], heap[min])) min = r;
+        if (min == i) return;
+
+        uint16_t tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+// Per-track inclusive prefix sum of the delta times, written to the
+// run's tick fields. Deltas are VLQs of at most 28 bits, so the partial
+// sums of a block of four fit 32-bit lanes: the in-block scan is done
+// with two shifted adds and only the 64-bit carry is serial.
+static void track_prefix_ticks(const MTrk *track, Timed_event *run)
+{
+    const MTrk_event *ev = track->events;
+    size_t n = track->count;
+    size_t k = 0;
+    uint64_t carry = 0;
+#ifdef __SSE2__
+    for (; k + 4 <= n; k += 4)
+    {
+        __m128i d = _mm_set_epi32((int)ev[k + 3].delta_time, (int)ev[k + 2].delta_time,
+                                  (int)ev[k + 1].delta_time, (int)ev[k].delta_time);
+        d = _mm_add_epi32(d, _mm_slli_si128(d, 4));
+        d = _mm_add_epi32(d, _mm_slli_si128(d, 8));
+
+        uint32_t local[4];
+        _mm_storeu_si128((__m128i*)local, d);
+        run[k].tick     = carry + local[0];
+        run[k + 1].tick = carry + local[1];
+        run[k + 2].tick = carry + local[2];
+        run[k + 3].tick = carry + local[3];
+        carry += local[3];
+    }
+#endif
+    for (; k < n; ++k)
+    {
+        carry += ev[k].delta_time;
+        run[k].tick = carry;
+    }
+}
+
+typedef struct
+{
+    const MIDI_file *midi;
+    const Tempo_map *tmap;
+    uint32_t         sample_rate;
+    Timed_event     *runs;
+    const size_t    *run_start;
+    uint32_t         next_track;
+#ifndef _WIN32
+    pthread_mutex_t  lock;
+#endif
+} Merge_job;
+
+static void timestamp_track(const Merge_job *job, uint16_t t)
+{
+    const MTrk *track = &job->midi->mtrk[t];
+    Timed_event *run = &job->runs[job->run_start[t]];
+    track_prefix_ticks(track, run);
+
+    Tick_clock clk;
+    tick_clock_init(&clk, &job->midi->mthd, job->tmap, job->sample_rate);
+    for (size_t k = 0; k < track->count; ++k)
+    {
+        uint64_t num = tick_clock_numerator(&clk, run[k].tick);
+        run[k].timestamp_ms = tick_clock_milliseconds(&clk, num);
+        run[k].sample       = tick_clock_samples(&clk, num);
+        run[k].track_idx    = t;
+        run[k].event        = &track->events[k];
+    }
+}
+
+static void *merge_worker(void *arg)
+{
+    Merge_job *job = (Merge_job*)arg;
+    uint32_t ntracks = job->midi->mthd.ntracks;
+    for (;;)
+    {
+#ifndef _WIN32
+        pthread_mutex_lock(&job->lock);
+#endif
+        uint32_t t = job->next_track;
+        if (t < ntracks) job->next_track++;
+#ifndef _WIN32
+        pthread_mutex_unlock(&job->lock);
+#endif
+        if (t >= ntracks) return NULL;
+        timestamp_track(job, (uint16_t)t);
+    }
+}
+
+static unsigned default_thread_count(void)
+{
+#ifndef _WIN32
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0) return (unsigned)n;
+#endif
+    return 1;
 }
 
-Timeline merge_tracks_to_timeline(const MIDI_file *midi, const Tempo_map *tmap, int *status)
+// Tracks are timestamped independently (on worker threads when asked
+// to) into sorted per-track runs that are then k-way merged by
+// (tick, track). nthreads == 0 uses one thread per online CPU.
+Timeline merge_tracks_to_timeline_parallel(const MIDI_file *midi, const Tempo_map *tmap, uint32_t sample_rate,
+                                           unsigned nthreads, int *status)
 {
     Timeline timeline = { 0 };
+    timeline.sample_rate = sample_rate;
     uint16_t ntracks = midi->mthd.ntracks;
+
+    size_t total = 0;
+    size_t nonempty = 0;
+    size_t *run_start = malloc((ntracks + 1u) * sizeof(size_t));
+    if (!run_start)
+    {
+        *status = -1;
+        return timeline;
+    }
     for (uint16_t i = 0; i < ntracks; ++i)
     {
-        MTrk *curr_track = &midi->mtrk[i];
-        uint64_t cum_ticks = 0;
-        for (size_t k = 0; k < curr_track->count; ++k)
-        {
-            MTrk_event *curr_ev = &curr_track->events[k];
-            cum_ticks += curr_ev->delta_time;
-            double timestamp_ms = tick_to_milliseconds(cum_ticks, &midi->mthd, tmap);
-            if (!timeline_ensure_one(&timeline))
-            {
-                *status = -1;
-                free_timeline(&timeline);
-                return timeline;
-            }
-            Timed_event tev;
-            tev.timestamp_ms = timestamp_ms;
-            tev.track_idx    = i;
-            tev.event        = curr_ev;
+        run_start[i] = total;
+        total += midi->mtrk[i].count;
+        nonempty += midi->mtrk[i].count > 0;
+    }
+    run_start[ntracks] = total;
+
+    if (total == 0)
+    {
+        free(run_start);
+        *status = 0;
+        return timeline;
+    }
 
-            timeline.events[timeline.count++] = tev;
+    Timed_event *runs = malloc(total * sizeof(Timed_event));
+    if (!runs)
+    {
+        free(run_start);
+        *status = -1;
+        return timeline;
+    }
+
+    Merge_job job;
+    job.midi        = midi;
+    job.tmap        = tmap;
+    job.sample_rate = sample_rate;
+    job.runs        = runs;
+    job.run_start   = run_start;
+    job.next_track  = 0;
+
+    if (nthreads == 0) nthreads = default_thread_count();
+    if (nthreads > ntracks) nthreads = ntracks;
+#ifndef _WIN32
+    pthread_t *workers = NULL;
+    unsigned nworkers = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    if (nthreads > 1)
+        workers = malloc((nthreads - 1) * sizeof(pthread_t));
+    if (workers)
+    {
+        for (unsigned w = 0; w + 1 < nthreads; ++w)
+        {
+            if (pthread_create(&workers[nworkers], NULL, merge_worker, &job) != 0) break;
+            nworkers++;
         }
     }
-    qsort(timeline.events, timeline.count, sizeof(Timed_event), compare_timed_event);
+    merge_worker(&job);
+    for (unsigned w = 0; w < nworkers; ++w)
+        pthread_join(workers[w], NULL);
+    free(workers);
+    pthread_mutex_destroy(&job.lock);
+#else
+    merge_worker(&job);
+#endif
+
+    // a single run is already the timeline
+    if (nonempty == 1)
+    {
+        free(run_start);
+        timeline.events = runs;
+        timeline.count  = total;
+        timeline.cap    = total;
+        *status = 0;
+        return timeline;
+    }
+
+    Timeline_stream ts = { 0 };
+    ts.cursors = malloc(ntracks * sizeof(Track_cursor));
+    ts.heap    = malloc(ntracks * sizeof(uint16_t));
+    if (!ts.cursors || !ts.heap || !timeline_grow(&timeline, total))
+    {
+        close_timeline_stream(&ts);
+        free(runs);
+        free(run_start);
+        *status = -1;
+        return timeline;
+    }
+
+    for (uint16_t i = 0; i < ntracks; ++i)
+    {
+        ts.cursors[i].pos = run_start[i];
+        if (run_start[i] == run_start[i + 1]) continue;
+
+        ts.cursors[i].tick = runs[run_start[i]].tick;
+        ts.heap[ts.heap_count++] = i;
+    }
+    for (size_t i = ts.heap_count / 2; i-- > 0; )
+        stream_sift_down(&ts, i);
+
+    while (ts.heap_count > 0)
+    {
+        uint16_t t = ts.heap[0];
+        Track_cursor *cur = &ts.cursors[t];
+        timeline.events[timeline.count++] = runs[cur->pos];
+
+        if (++cur->pos < run_start[t + 1])
+            cur->tick = runs[cur->pos].tick;
+        else
+            ts.heap[0] = ts.heap[--ts.heap_count];
+        stream_sift_down(&ts, 0);
+    }
+
+    close_timeline_stream(&ts);
+    free(runs);
+    free(run_start);
 
     *status = 0;
     return timeline;
 }
 
+Timeline merge_tracks_to_timeline(const MIDI_file *midi, const Tempo_map *tmap, uint32_t sample_rate, int *status)
+{
+    return merge_tracks_to_timeline_parallel(midi, tmap, sample_rate, 1, status);
+}
+
 void free_timeline(Timeline *timeline)
 {
     if (timeline && timeline->events)
@@ -226,4 +518,996 @@ void free_timeline(Timeline *timeline)
         timeline->count = 0;
         timeline->cap = 0;
     }
+}
+
+static inline int timed_event_less(const Timed_event *a, const Timed_event *b)
+{
+    if (a->tick != b->tick) return a->tick < b->tick;
+    if (a->track_idx != b->track_idx) return a->track_idx < b->track_idx;
+    return a->event < b->event;
+}
+
+static inline void timed_event_retime(Timed_event *tev, Tick_clock *clk)
+{
+    uint64_t num = tick_clock_numerator(clk, tev->tick);
+    tev->timestamp_ms = tick_clock_milliseconds(clk, num);
+    tev->sample       = tick_clock_samples(clk, num);
+}
+
+// first entry from `lo` on that does not sort before `key`
+static size_t timeline_lower_bound(const Timeline *timeline, size_t lo, const Timed_event *key)
+{
+    size_t hi = timeline->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (timed_event_less(&timeline->events[mid], key)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static size_t timeline_first_at_tick(const Timeline *timeline, uint64_t tick)
+{
+    size_t lo = 0, hi = timeline->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (timeline->events[mid].tick < tick) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static size_t tempo_map_lower_bound(const Tempo_map *tmap, const Tempo_change *key)
+{
+    size_t lo = 0, hi = tmap->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (compare_tempo_tick(&tmap->changes[mid], key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// the map must have room for one more change
+static void tempo_map_insert(Tempo_map *tmap, const Tempo_change *tc)
+{
+    size_t pos = tempo_map_lower_bound(tmap, tc);
+    memmove(&tmap->changes[pos + 1], &tmap->changes[pos], (tmap->count - pos) * sizeof(Tempo_change));
+    tmap->changes[pos] = *tc;
+    tmap->count++;
+}
+
+static void free_event_payload(MTrk_event *ev)
+{
+    if (ev->kind == META)     free(ev->meta_ev.data);
+    else if (ev->kind == SYS) free(ev->sysex_ev.data);
+}
+
+// Replaces edit->remove_count events of one track, starting at
+// edit->first, with the edit->insert events (whose payloads the track
+// takes over) and patches the tempo map and, unless it is NULL, the
+// timeline to match. The track's size, its length in the file, is not
+// updated.
+//
+// Everything is spliced in place. The timeline entries the edit touches
+// lie between two binary-searched positions; only they are merged again,
+// and the entries after them are moved up or down with one memmove. When
+// the edit moves later events of the track in time, the range extends to
+// the end of the timeline. A tempo edit also re-timestamps every event
+// from the first affected tempo change on. Entries of the track after the
+// range point at events that moved, so an edit that changes the track's
+// length also repoints those.
+int apply_track_edit(MIDI_file *midi, Tempo_map *tmap, Timeline *timeline, const Track_edit *edit)
+{
+    uint16_t t = edit->track_idx;
+    if (t >= midi->mthd.ntracks) return 0;
+
+    MTrk *track = &midi->mtrk[t];
+    size_t first     = edit->first;
+    size_t removed   = edit->remove_count;
+    size_t inserted  = edit->insert_count;
+    size_t old_count = track->count;
+    uint64_t base_tick = edit->tick;
+    if (first > old_count || removed > old_count - first) return 0;
+    if (inserted > SIZE_MAX / 2 / sizeof(MTrk_event) - old_count) return 0;
+    if (first == 0 && base_tick != 0) return 0;
+
+    size_t new_count = old_count - removed + inserted;
+    MTrk_event *old_events = track->events;
+
+    // tick of the last replaced event, or base_tick if none is
+    uint64_t removed_end = base_tick;
+    for (size_t k = 0; k < removed; ++k)
+        removed_end += old_events[first + k].delta_time;
+
+    int64_t shift = -(int64_t)(removed_end - base_tick);
+    size_t new_tempos = 0;
+    for (size_t k = 0; k < inserted; ++k)
+    {
+        Tempo_change tc;
+        shift += edit->insert[k].delta_time;
+        new_tempos += tempo_change_from_event(&edit->insert[k], 0, t, 0, &tc);
+    }
+
+    // tempo changes of the track from `first` on; those after the replaced
+    // range move with a shifted track and are inserted again
+    Tempo_change key = { 0 };
+    key.tick      = base_tick;
+    key.track_idx = t;
+    key.event_idx = first;
+    size_t tempo_start = tempo_map_lower_bound(tmap, &key);
+    size_t moved_tempos = 0;
+    if (shift != 0)
+    {
+        for (size_t i = tempo_start; i < tmap->count; ++i)
+            moved_tempos += tmap->changes[i].track_idx == t && tmap->changes[i].event_idx >= first + removed;
+    }
+
+    // the new events from first to run_end take the place of the timeline
+    // entries between w0 and w1: the replaced ones, or the rest of the track
+    // when it shifted
+    size_t run_end = shift == 0 ? first + inserted : new_count;
+    size_t run_len = run_end - first;
+    size_t w0 = 0, w1 = 0;
+    if (timeline)
+    {
+        Timed_event probe;
+        probe.track_idx = t;
+        if (first > 0)
+        {
+            // the edit's tick must be where the timeline has the event before it
+            probe.tick  = base_tick;
+            probe.event = &old_events[first - 1];
+            w0 = timeline_lower_bound(timeline, 0, &probe);
+            if (w0 == timeline->count || timeline->events[w0].event != probe.event) return 0;
+        }
+        probe.tick  = base_tick;
+        probe.event = &old_events[first];
+        w0 = timeline_lower_bound(timeline, w0, &probe);
+        probe.tick  = removed_end;
+        probe.event = &old_events[first + removed];
+        w1 = shift == 0 ? timeline_lower_bound(timeline, w0, &probe) : timeline->count;
+    }
+
+    MTrk_event   *new_events = old_events;
+    size_t        new_cap    = track->cap;
+    Tempo_change *moved      = NULL;
+    Timed_event  *run        = NULL;
+    if (new_count > track->cap)
+    {
+        new_cap = track->cap > 16 ? track->cap : 16;
+        while (new_cap < new_count) new_cap *= 2;
+        new_events = malloc(new_cap * sizeof(MTrk_event));
+    }
+    if (moved_tempos > 0)
+        moved = malloc(moved_tempos * sizeof(Tempo_change));
+    if (timeline && run_len > 0)
+        run = malloc(run_len * sizeof(Timed_event));
+    if (!new_events || (moved_tempos > 0 && !moved) || (timeline && run_len > 0 && !run) ||
+        !tempo_map_grow(tmap, tmap->count + new_tempos + 1) ||
+        (timeline && !timeline_grow(timeline, timeline->count + run_len)))
+    {
+        if (new_events != old_events) free(new_events);
+        free(moved);
+        free(run);
+        return 0;
+    }
+
+    // splice the track; a grown track keeps the old array until the
+    // timeline no longer points into it
+    for (size_t k = 0; k < removed; ++k)
+        free_event_payload(&old_events[first + k]);
+    size_t tail = old_count - first - removed;
+    if (new_events != old_events)
+    {
+        memcpy(new_events, old_events, first * sizeof(MTrk_event));
+        memcpy(&new_events[first + inserted], &old_events[first + removed], tail * sizeof(MTrk_event));
+    }
+    else
+        memmove(&new_events[first + inserted], &old_events[first + removed], tail * sizeof(MTrk_event));
+    if (inserted > 0)
+        memcpy(&new_events[first], edit->insert, inserted * sizeof(MTrk_event));
+    track->events = new_events;
+    track->count  = new_count;
+    track->cap    = new_cap;
+
+    // patch the tempo map, remembering the earliest tick whose tempo changed.
+    // The default tempo only stands in for a map without changes
+    uint64_t tempo_from = UINT64_MAX;
+    uint32_t old_initial = tmap->count ? tmap->changes[0].us_per_qn : 0;
+    int had_default = 0;
+    if (tmap->count == 1 && tmap->changes[0].track_idx == TEMPO_DEFAULT_TRACK)
+    {
+        had_default = 1;
+        tmap->count = tempo_start = 0;
+    }
+    size_t kept = tempo_start;
+    size_t nmoved = 0;
+    for (size_t i = tempo_start; i < tmap->count; ++i)
+    {
+        Tempo_change tc = tmap->changes[i];
+        if (tc.track_idx == t && tc.event_idx >= first)
+        {
+            if (tc.event_idx < first + removed)
+            {
+                if (tc.tick < tempo_from) tempo_from = tc.tick;
+                continue;
+            }
+            tc.event_idx = tc.event_idx - removed + inserted;
+            if (shift != 0)
+            {
+                if (tc.tick < tempo_from) tempo_from = tc.tick;
+                tc.tick = (uint64_t)((int64_t)tc.tick + shift);
+                if (tc.tick < tempo_from) tempo_from = tc.tick;
+                moved[nmoved++] = tc;
+                continue;
+            }
+        }
+        tmap->changes[kept++] = tc;
+    }
+    tmap->count = kept;
+    for (size_t k = 0; k < nmoved; ++k)
+        tempo_map_insert(tmap, &moved[k]);
+
+    uint64_t tick = base_tick;
+    for (size_t k = first; k < first + inserted; ++k)
+    {
+        Tempo_change tc;
+        tick += new_events[k].delta_time;
+        if (tempo_change_from_event(&new_events[k], tick, t, k, &tc))
+        {
+            tempo_map_insert(tmap, &tc);
+            if (tc.tick < tempo_from) tempo_from = tc.tick;
+        }
+    }
+    if (tmap->count == 0)
+        tempo_change_default(&tmap->changes[tmap->count++]);
+    else if (had_default)
+        tempo_from = 0;
+
+    // the first tempo also rules every tick before it
+    if (tmap->changes[0].us_per_qn != old_initial)
+        tempo_from = 0;
+
+    if (timeline)
+    {
+        Tick_clock clk;
+        tick_clock_init(&clk, &midi->mthd, tmap, timeline->sample_rate);
+        tick = base_tick;
+        for (size_t k = first; k < run_end; ++k)
+        {
+            Timed_event *tev = &run[k - first];
+            tick += new_events[k].delta_time;
+            tev->tick      = tick;
+            tev->track_idx = t;
+            tev->event     = &new_events[k];
+            timed_event_retime(tev, &clk);
+        }
+
+        // between w0 and w1 the track only has the entries being replaced;
+        // the other tracks' entries there are kept in order
+        Timed_event *events = timeline->events;
+        size_t keep_end = w0;
+        for (size_t i = w0; i < w1; ++i)
+        {
+            if (events[i].track_idx != t)
+                events[keep_end++] = events[i];
+        }
+
+        size_t out_end = keep_end + run_len;
+        memmove(&events[out_end], &events[w1], (timeline->count - w1) * sizeof(Timed_event));
+        timeline->count = timeline->count - w1 + out_end;
+
+        // merge from the back so kept entries move at most once
+        size_t i = keep_end, j = run_len, out = out_end;
+        while (j > 0)
+        {
+            if (i > w0 && timed_event_less(&run[j - 1], &events[i - 1]))
+                events[--out] = events[--i];
+            else
+                events[--out] = run[--j];
+        }
+
+        // the track's entries outside the range, if their events moved
+        if (new_events != old_events)
+        {
+            for (size_t k = 0; k < w0; ++k)
+            {
+                if (events[k].track_idx == t)
+                    events[k].event = &new_events[events[k].event - old_events];
+            }
+        }
+        if (new_events != old_events || inserted != removed)
+        {
+            for (size_t k = out_end; k < timeline->count; ++k)
+            {
+                if (events[k].track_idx == t)
+                    events[k].event = &new_events[events[k].event - old_events - removed + inserted];
+            }
+        }
+
+        if (tempo_from != UINT64_MAX)
+        {
+            tick_clock_init(&clk, &midi->mthd, tmap, timeline->sample_rate);
+            for (size_t k = timeline_first_at_tick(timeline, tempo_from); k < timeline->count; ++k)
+                timed_event_retime(&events[k], &clk);
+        }
+    }
+
+    if (new_events != old_events) free(old_events);
+    free(moved);
+    free(run);
+    return 1;
+}
+
+static int render_stream_grow(Render_stream *rs, size_t min_needed)
+{
+    size_t cap = rs->cap ? rs->cap : 256;
+    while (cap < min_needed)
+    {
+        if (cap > SIZE_MAX / 2) return 0;
+        cap *= 2;
+    }
+    if (cap > SIZE_MAX / sizeof(Render_cmd)) return 0;
+
+    Render_cmd *rc = realloc(rs->cmds, cap * sizeof(*rc));
+    if (!rc) return 0;
+
+    rs->cmds = rc;
+    rs->cap = cap;
+    return 1;
+}
+
+int render_cmd_from_event(const Timed_event *tev, Render_cmd *cmd)
+{
+    const MTrk_event *ev = tev->event;
+    if (ev->kind == META && ev->meta_ev.type == 0x51 && ev->meta_ev.len >= 3)
+    {
+        const uint8_t *data = (const uint8_t*)ev->meta_ev.data;
+        cmd->sample  = tev->sample;
+        cmd->op      = RC_TEMPO;
+        cmd->channel = data[0];
+        cmd->note    = data[1];
+        cmd->value   = data[2];
+        return 1;
+    }
+    if (ev->kind != CH) return 0;
+
+    uint8_t type = ev->channel_ev.type;
+    cmd->sample  = tev->sample;
+    cmd->channel = ev->channel_ev.channel;
+    cmd->note    = ev->channel_ev.param1;
+    cmd->value   = ev->channel_ev.param2;
+
+    if (type == 0x9 && ev->channel_ev.param2 > 0)
+    {
+        cmd->op = RC_NOTE_ON;
+        return 1;
+    }
+    if (type == 0x8 || type == 0x9)
+    {
+        cmd->op    = RC_NOTE_OFF;
+        cmd->value = 0;
+        return 1;
+    }
+    if (type == 0xB)
+    {
+        cmd->op = RC_CONTROL;
+        return 1;
+    }
+    if (type == 0xC)
+    {
+        cmd->op    = RC_PROGRAM;
+        cmd->value = ev->channel_ev.param1;
+        cmd->note  = 0;
+        return 1;
+    }
+    if (type == 0xE)
+    {
+        cmd->op = RC_PITCH_BEND;
+        return 1;
+    }
+    return 0;
+}
+
+uint32_t render_cmd_tempo(const Render_cmd *cmd)
+{
+    return ((uint32_t)cmd->channel << 16) | ((uint32_t)cmd->note << 8) | cmd->value;
+}
+
+Render_stream build_render_stream(const Timeline *timeline, int *status)
+{
+    Render_stream rs = { 0 };
+    rs.sample_rate = timeline->sample_rate;
+    if (timeline->count > 0)
+        rs.end_sample = timeline->events[timeline->count - 1].sample;
+
+    // channel messages are a fraction of the timeline, count them first
+    size_t needed = 0;
+    Render_cmd cmd;
+    for (size_t i = 0; i < timeline->count; ++i)
+        needed += render_cmd_from_event(&timeline->events[i], &cmd);
+
+    if (needed > 0 && !render_stream_grow(&rs, needed))
+    {
+        *status = -1;
+        return rs;
+    }
+
+    for (size_t i = 0; i < timeline->count; ++i)
+    {
+        if (render_cmd_from_event(&timeline->events[i], &cmd))
+            rs.cmds[rs.count++] = cmd;
+    }
+
+    *status = 0;
+    return rs;
+}
+
+void free_render_stream(Render_stream *rs)
+{
+    if (rs && rs->cmds)
+    {
+        free(rs->cmds);
+        rs->cmds = NULL;
+        rs->count = 0;
+        rs->cap = 0;
+    }
+}
+
+uint64_t timeline_end_sample(const MIDI_file *midi, const Tempo_map *tmap, uint32_t sample_rate)
+{
+    uint64_t end_tick = 0;
+    for (uint16_t i = 0; i < midi->mthd.ntracks; ++i)
+    {
+        const MTrk *track = &midi->mtrk[i];
+        uint64_t cum_ticks = 0;
+        for (size_t k = 0; k < track->count; ++k)
+            cum_ticks += track->events[k].delta_time;
+        if (cum_ticks > end_tick) end_tick = cum_ticks;
+    }
+    return tick_to_sample(end_tick, &midi->mthd, tmap, sample_rate);
+}
+
+Timeline_stream open_timeline_stream(const MIDI_file *midi, const Tempo_map *tmap, uint32_t sample_rate, int *status)
+{
+    Timeline_stream ts = { 0 };
+    uint16_t ntracks = midi->mthd.ntracks;
+
+    ts.midi    = midi;
+    ts.cursors = malloc(ntracks * sizeof(Track_cursor));
+    ts.heap    = malloc(ntracks * sizeof(uint16_t));
+    if (!ts.cursors || !ts.heap)
+    {
+        close_timeline_stream(&ts);
+        *status = -1;
+        return ts;
+    }
+    tick_clock_init(&ts.clk, &midi->mthd, tmap, sample_rate);
+
+    for (uint16_t i = 0; i < ntracks; ++i)
+    {
+        ts.cursors[i].pos  = 0;
+        ts.cursors[i].tick = 0;
+        if (midi->mtrk[i].count == 0) continue;
+
+        ts.cursors[i].tick = midi->mtrk[i].events[0].delta_time;
+        ts.heap[ts.heap_count++] = i;
+    }
+    for (size_t i = ts.heap_count / 2; i-- > 0; )
+        stream_sift_down(&ts, i);
+
+    *status = 0;
+    return ts;
+}
+
+int timeline_stream_next(Timeline_stream *ts, Timed_event *out)
+{
+    if (ts->heap_count == 0) return 0;
+
+    uint16_t track_idx = ts->heap[0];
+    Track_cursor *cur  = &ts->cursors[track_idx];
+    const MTrk *track  = &ts->midi->mtrk[track_idx];
+    uint64_t num       = tick_clock_numerator(&ts->clk, cur->tick);
+
+    out->timestamp_ms = tick_clock_milliseconds(&ts->clk, num);
+    out->tick         = cur->tick;
+    out->sample       = tick_clock_samples(&ts->clk, num);
+    out->track_idx    = track_idx;
+    out->event        = &track->events[cur->pos];
+
+    if (++cur->pos < track->count)
+        cur->tick += track->events[cur->pos].delta_time;
+    else
+        ts->heap[0] = ts->heap[--ts->heap_count];
+    stream_sift_down(ts, 0);
+
+    return 1;
+}
+
+int timeline_stream_next_cmd(Timeline_stream *ts, Render_cmd *cmd)
+{
+    Timed_event tev;
+    while (timeline_stream_next(ts, &tev))
+    {
+        if (render_cmd_from_event(&tev, cmd)) return 1;
+    }
+    return 0;
+}
+
+void close_timeline_stream(Timeline_stream *ts)
+{
+    if (ts)
+    {
+        free(ts->cursors);
+        free(ts->heap);
+        ts->cursors = NULL;
+        ts->heap = NULL;
+        ts->heap_count = 0;
+    }
+}
+
+static int note_list_grow(Note_list *nl, size_t min_needed)
+{
+    size_t cap = nl->cap ? nl->cap : 256;
+    while (cap < min_needed)
+    {
+        if (cap > SIZE_MAX / 2) return 0;
+        cap *= 2;
+    }
+    if (cap > SIZE_MAX / sizeof(Note)) return 0;
+
+    Note *n = realloc(nl->notes, cap * sizeof(*n));
+    if (!n) return 0;
+
+    nl->notes = n;
+    nl->cap = cap;
+    return 1;
+}
+
+static inline int note_list_ensure_one(Note_list *nl)
+{
+    if (nl->count < nl->cap) return 1;
+    return note_list_grow(nl, nl->count + 1);
+}
+
+static int compare_note(const void *a, const void *b)
+{
+    const Note *na = (const Note*)a;
+    const Note *nb = (const Note*)b;
+    if (na->start_sample < nb->start_sample) return -1;
+    if (na->start_sample > nb->start_sample) return  1;
+    if (na->track_idx != nb->track_idx) return na->track_idx < nb->track_idx ? -1 : 1;
+    if (na->channel   != nb->channel)   return na->channel   < nb->channel   ? -1 : 1;
+    if (na->pitch     != nb->pitch)     return na->pitch     < nb->pitch     ? -1 : 1;
+    return 0;
+}
+
+#define NOTE_KEYS  (16 * 128)
+#define NO_NOTE    SIZE_MAX
+
+// Notes are paired the way the synth plays them: a retriggered key keeps
+// every instance, and a Note Off ends all instances of its (channel, note),
+// whichever track started them. The tracks are walked in timeline order
+// for that. While a note is open its duration field links to the next open
+// note on the same key; notes still open at the end of their track are
+// closed there.
+Note_list extract_note_list(const MIDI_file *midi, const Tempo_map *tmap, uint32_t sample_rate, int *status)
+{
+    Note_list nl = { 0 };
+    nl.sample_rate = sample_rate;
+
+    uint16_t ntracks = midi->mthd.ntracks;
+    size_t   *open_head = malloc(NOTE_KEYS * sizeof(size_t));
+    uint64_t *track_end = malloc((ntracks ? ntracks : 1) * sizeof(uint64_t));
+    Timeline_stream ts = open_timeline_stream(midi, tmap, sample_rate, status);
+    if (!open_head || !track_end || *status != 0)
+    {
+        free(open_head);
+        free(track_end);
+        close_timeline_stream(&ts);
+        *status = -1;
+        return nl;
+    }
+    for (size_t key = 0; key < NOTE_KEYS; ++key)
+        open_head[key] = NO_NOTE;
+    for (uint16_t i = 0; i < ntracks; ++i)
+        track_end[i] = 0;
+
+    Timed_event tev;
+    while (timeline_stream_next(&ts, &tev))
+    {
+        const MTrk_event *ev = tev.event;
+        track_end[tev.track_idx] = tev.sample;
+        if (ev->kind != CH) continue;
+
+        uint8_t type = ev->channel_ev.type;
+        if (type != 0x8 && type != 0x9) continue;
+
+        size_t key = (size_t)ev->channel_ev.channel * 128 + ev->channel_ev.param1;
+        if (type == 0x9 && ev->channel_ev.param2 > 0)
+        {
+            if (!note_list_ensure_one(&nl))
+            {
+                free(open_head);
+                free(track_end);
+                close_timeline_stream(&ts);
+                free_note_list(&nl);
+                *status = -1;
+                return nl;
+            }
+            Note *n = &nl.notes[nl.count];
+            n->start_sample = tev.sample;
+            n->duration     = open_head[key];
+            n->track_idx    = tev.track_idx;
+            n->channel      = ev->channel_ev.channel;
+            n->pitch        = ev->channel_ev.param1;
+            n->velocity     = ev->channel_ev.param2;
+            open_head[key]  = nl.count++;
+        }
+        else
+        {
+            for (size_t idx = open_head[key]; idx != NO_NOTE; )
+            {
+                Note *n = &nl.notes[idx];
+                idx = (size_t)n->duration;
+                n->duration = tev.sample - n->start_sample;
+            }
+            open_head[key] = NO_NOTE;
+        }
+    }
+    close_timeline_stream(&ts);
+
+    // dangling notes
+    for (size_t key = 0; key < NOTE_KEYS; ++key)
+    {
+        for (size_t idx = open_head[key]; idx != NO_NOTE; )
+        {
+            Note *n = &nl.notes[idx];
+            idx = (size_t)n->duration;
+            n->duration = track_end[n->track_idx] - n->start_sample;
+        }
+    }
+    free(open_head);
+    free(track_end);
+
+    qsort(nl.notes, nl.count, sizeof(Note), compare_note);
+
+    *status = 0;
+    return nl;
+}
+
+void free_note_list(Note_list *nl)
+{
+    if (nl && nl->notes)
+    {
+        free(nl->notes);
+        nl->notes = NULL;
+        nl->count = 0;
+        nl->cap = 0;
+    }
+}
+
+static int seek_index_grow(Seek_index *idx, size_t min_needed)
+{
+    size_t cap = idx->cap ? idx->cap : 16;
+    while (cap < min_needed)
+    {
+        if (cap > SIZE_MAX / 2) return 0;
+        cap *= 2;
+    }
+    if (cap > SIZE_MAX / sizeof(Keyframe)) return 0;
+
+    Keyframe *kf = realloc(idx->keyframes, cap * sizeof(*kf));
+    if (!kf) return 0;
+
+    idx->keyframes = kf;
+    idx->cap = cap;
+    return 1;
+}
+
+static int held_notes_grow(Held_note **notes, size_t *cap, size_t min_needed)
+{
+    size_t new_cap = *cap ? *cap : 64;
+    while (new_cap < min_needed)
+    {
+        if (new_cap > SIZE_MAX / 2) return 0;
+        new_cap *= 2;
+    }
+    if (new_cap > SIZE_MAX / sizeof(Held_note)) return 0;
+
+    Held_note *hn = realloc(*notes, new_cap * sizeof(*hn));
+    if (!hn) return 0;
+
+    *notes = hn;
+    *cap = new_cap;
+    return 1;
+}
+
+static void keyframe_reset(Keyframe *kf)
+{
+    memset(kf, 0, sizeof(*kf));
+    kf->us_per_qn = 500000;
+    for (int ch = 0; ch < 16; ++ch)
+    {
+        kf->pitch_bend[ch]        = 8192;
+        kf->controllers[ch][7]    = 100;
+        kf->controllers[ch][10]   = 64;
+        kf->controllers[ch][11]   = 127;
+        // no registered parameter selected
+        kf->controllers[ch][100]  = 127;
+        kf->controllers[ch][101]  = 127;
+        kf->rpn_msb[ch]           = 127;
+        kf->rpn_lsb[ch]           = 127;
+        kf->bend_semitones[ch]    = 2;
+    }
+}
+
+// A keyframe holds the playback state right before its sample: every
+// event at an earlier sample has been applied, the events from
+// timeline_pos / stream_pos on have not.
+Seek_index build_seek_index(const Timeline *timeline, double interval_seconds, int *status)
+{
+    Seek_index idx = { 0 };
+    idx.interval = (uint64_t)(interval_seconds * timeline->sample_rate);
+    if (idx.interval == 0)
+    {
+        *status = -1;
+        return idx;
+    }
+
+    Keyframe state;
+    keyframe_reset(&state);
+    Held_note *held = NULL;
+    size_t held_count = 0, held_cap = 0;
+
+    // the synth counts quarter notes at each tempo from the sample it
+    // takes effect
+    double beats_per_sample = 1e6 / ((double)state.us_per_qn * timeline->sample_rate);
+    uint64_t tempo_sample = 0;
+    double tempo_beat = 0.0;
+
+    uint64_t next_kf = 0;
+    size_t stream_pos = 0;
+    for (size_t i = 0; i < timeline->count; ++i)
+    {
+        const Timed_event *tev = &timeline->events[i];
+        while (next_kf <= tev->sample)
+        {
+            if (!seek_index_grow(&idx, idx.count + 1) ||
+                (held_count > 0 && !held_notes_grow(&idx.notes, &idx.note_cap, idx.note_count + held_count)))
+            {
+                free(held);
+                free_seek_index(&idx);
+                *status = -1;
+                return idx;
+            }
+            Keyframe *kf = &idx.keyframes[idx.count++];
+            *kf = state;
+            kf->sample       = next_kf;
+            kf->beat         = tempo_beat + (double)(next_kf - tempo_sample) * beats_per_sample;
+            kf->timeline_pos = i;
+            kf->stream_pos   = stream_pos;
+            kf->first_note   = idx.note_count;
+            kf->note_count   = held_count;
+            if (held_count > 0)
+                memcpy(&idx.notes[idx.note_count], held, held_count * sizeof(Held_note));
+            idx.note_count += held_count;
+            next_kf += idx.interval;
+        }
+
+        Render_cmd cmd;
+        if (render_cmd_from_event(tev, &cmd))
+        {
+            stream_pos++;
+            if (cmd.op == RC_TEMPO)
+            {
+                tempo_beat += (double)(tev->sample - tempo_sample) * beats_per_sample;
+                tempo_sample = tev->sample;
+                state.us_per_qn = render_cmd_tempo(&cmd);
+                beats_per_sample = 1e6 / ((double)(state.us_per_qn ? state.us_per_qn : 500000) * timeline->sample_rate);
+            }
+        }
+
+        const MTrk_event *ev = tev->event;
+        if (ev->kind != CH) continue;
+
+        uint8_t ch = ev->channel_ev.channel;
+        uint8_t p1 = ev->channel_ev.param1;
+        uint8_t p2 = ev->channel_ev.param2;
+        switch (ev->channel_ev.type)
+        {
+        case 0x8:
+        case 0x9:
+            if (ev->channel_ev.type == 0x9 && p2 > 0)
+            {
+                if (held_count == held_cap && !held_notes_grow(&held, &held_cap, held_count + 1))
+                {
+                    free(held);
+                    free_seek_index(&idx);
+                    *status = -1;
+                    return idx;
+                }
+                held[held_count].start_sample = tev->sample;
+                held[held_count].channel      = ch;
+                held[held_count].note         = p1;
+                held[held_count].velocity     = p2;
+                held_count++;
+            }
+            else
+            {
+                // a Note Off releases every instance of the key
+                size_t kept = 0;
+                for (size_t k = 0; k < held_count; ++k)
+                {
+                    if (held[k].channel != ch || held[k].note != p1)
+                        held[kept++] = held[k];
+                }
+                held_count = kept;
+            }
+            break;
+
+        case 0xB:
+            state.controllers[ch][p1] = p2;
+            // data entry only means something under the selection it was
+            // sent for, so the bend range is kept as set rather than replayed
+            switch (p1)
+            {
+            case 101: state.rpn_msb[ch] = p2; break;
+            case 100: state.rpn_lsb[ch] = p2; break;
+            case 99:
+            case 98:  state.rpn_msb[ch] = state.rpn_lsb[ch] = 127; break;
+            case 6:
+                if (state.rpn_msb[ch] == 0 && state.rpn_lsb[ch] == 0)
+                    state.bend_semitones[ch] = p2;
+                break;
+            case 38:
+                if (state.rpn_msb[ch] == 0 && state.rpn_lsb[ch] == 0)
+                    state.bend_cents[ch] = p2;
+                break;
+            }
+            break;
+
+        case 0xC:
+            state.program[ch] = p1;
+            break;
+
+        case 0xE:
+            state.pitch_bend[ch] = (uint16_t)(p1 | (p2 << 7));
+            break;
+        }
+    }
+    free(held);
+
+    *status = 0;
+    return idx;
+}
+
+const Keyframe *seek_index_find(const Seek_index *idx, uint64_t sample)
+{
+    if (idx->count == 0) return NULL;
+
+    size_t k = (size_t)(sample / idx->interval);
+    if (k >= idx->count) k = idx->count - 1;
+    return &idx->keyframes[k];
+}
+
+void free_seek_index(Seek_index *idx)
+{
+    if (idx)
+    {
+        free(idx->keyframes);
+        free(idx->notes);
+        idx->keyframes = NULL;
+        idx->notes = NULL;
+        idx->count = idx->cap = 0;
+        idx->note_count = idx->note_cap = 0;
+    }
+}
+
+// The scan models one voice per Note On that lives until its key is
+// released plus the release tail. Note Offs arrive in sample order and
+// the tail length is fixed, so pending tails form a FIFO.
+void polyphony_scan_init(Polyphony_scan *ps, uint64_t release_samples)
+{
+    memset(ps, 0, sizeof(*ps));
+    ps->release_samples = release_samples;
+}
+
+static void polyphony_scan_advance(Polyphony_scan *ps, uint64_t sample)
+{
+    while (ps->pending_count > 0 && ps->pending[ps->pending_head].end_sample <= sample)
+    {
+        Release_span *rs = &ps->pending[ps->pending_head];
+        ps->voice_samples += ps->active * (rs->end_sample - ps->last_sample);
+        ps->last_sample    = rs->end_sample;
+        ps->active        -= rs->count;
+        ps->pending_head++;
+        ps->pending_count--;
+    }
+    if (sample > ps->last_sample)
+    {
+        ps->voice_samples += ps->active * (sample - ps->last_sample);
+        ps->last_sample    = sample;
+    }
+}
+
+static int polyphony_scan_push(Polyphony_scan *ps, uint64_t end_sample, uint32_t count)
+{
+    if (ps->pending_head + ps->pending_count == ps->pending_cap)
+    {
+        if (ps->pending_head > 0)
+        {
+            memmove(ps->pending, &ps->pending[ps->pending_head], ps->pending_count * sizeof(Release_span));
+            ps->pending_head = 0;
+        }
+        else
+        {
+            size_t cap = ps->pending_cap ? ps->pending_cap * 2 : 64;
+            if (cap > SIZE_MAX / sizeof(Release_span)) return 0;
+
+            Release_span *rs = realloc(ps->pending, cap * sizeof(*rs));
+            if (!rs) return 0;
+
+            ps->pending = rs;
+            ps->pending_cap = cap;
+        }
+    }
+    Release_span *rs = &ps->pending[ps->pending_head + ps->pending_count++];
+    rs->end_sample = end_sample;
+    rs->count      = count;
+    return 1;
+}
+
+int polyphony_scan_feed(Polyphony_scan *ps, const Render_cmd *cmd)
+{
+    polyphony_scan_advance(ps, cmd->sample);
+
+    size_t key = (size_t)cmd->channel * 128 + cmd->note;
+    if (cmd->op == RC_NOTE_ON)
+    {
+        ps->held[key]++;
+        if (++ps->active > ps->peak) ps->peak = ps->active;
+    }
+    else if (cmd->op == RC_NOTE_OFF && ps->held[key] > 0)
+    {
+        if (!polyphony_scan_push(ps, cmd->sample + ps->release_samples, ps->held[key])) return 0;
+        ps->held[key] = 0;
+    }
+    return 1;
+}
+
+Polyphony_stats polyphony_scan_finish(Polyphony_scan *ps, uint64_t end_sample)
+{
+    polyphony_scan_advance(ps, end_sample);
+
+    Polyphony_stats stats;
+    stats.peak    = ps->peak;
+    stats.average = end_sample ? (double)ps->voice_samples / end_sample : 0.0;
+
+    free(ps->pending);
+    ps->pending = NULL;
+    ps->pending_head = ps->pending_count = ps->pending_cap = 0;
+    return stats;
+}
+
+Polyphony_stats scan_polyphony(const Render_stream *rs, uint64_t release_samples, int *status)
+{
+    Polyphony_scan ps;
+    polyphony_scan_init(&ps, release_samples);
+    for (size_t i = 0; i < rs->count; ++i)
+    {
+        if (!polyphony_scan_feed(&ps, &rs->cmds[i]))
+        {
+            polyphony_scan_finish(&ps, 0);
+            *status = -1;
+            return (Polyphony_stats){ 0 };
+        }
+    }
+
+    *status = 0;
+    return polyphony_scan_finish(&ps, rs->end_sample + release_samples);
 }
\ No newline at end of file
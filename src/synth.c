@@ -1,5 +1,8 @@
 #include "synth.h"
+#include "voice_kernel.h"
+#include "wavetable.h"
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifndef M_PI
@@ -11,257 +14,1294 @@ double midi_note_to_frequency(uint8_t note)
     return 440.0 * pow(2.0, (note - 69) / 12.0);
 }
 
-void oscillator_init(Oscillator *osc, Oscillator_type type, double frequency)
+#define LIN ENV_CURVE_LINEAR
+#define EXP ENV_CURVE_EXPONENTIAL
+#define LP  FILTER_LOWPASS
+#define BP  FILTER_BANDPASS
+#define HP  FILTER_HIGHPASS
+// the note's own pitch, with no sweep or noise
+#define PITCHED { 0.0, 1.0, 0.0, 0.0 }
+
+// modulation for the patches below
+//                                          shape            rate  pitch amp   pan  cutoff
+static const Synth_lfo lfo_vibrato      = { LFO_SINE,        2.5,  8.0,  0.0,  0.0, 0.0 };
+static const Synth_lfo lfo_rotary       = { LFO_SINE,        3.0,  4.0,  0.2,  0.3, 0.0 };
+static const Synth_lfo lfo_drift        = { LFO_TRIANGLE,    0.25, 0.0,  0.0,  0.5, 0.0 };
+static const Synth_lfo lfo_sweep        = { LFO_TRIANGLE,    0.5,  0.0,  0.0,  0.0, 1.5 };
+static const Synth_lfo lfo_sample_hold  = { LFO_SAMPLE_HOLD, 4.0,  0.0,  0.0,  0.2, 2.0 };
+
+// FM voices for the patches below
+static const Synth_fm fm_piano = { FM_PAIRS, 4, 0.0, {
+    //  ratio  level   attack decay sustain release
+    { 1.0,  1.8,  { 0.0,   0.8,  0.25,   0.3  } },  // body, into the oscillator
+    { 1.0,  0.35, { 0.0,   0.4,  0.0,    0.2  } },  // tine, heard
+    { 14.0, 0.9,  { 0.0,   0.08, 0.0,    0.05 } },  // tine strike, into the tine
+} };
+static const Synth_fm fm_bell = { FM_STACK, 2, 0.0, {
+    { 3.5,  2.2,  { 0.0,   0.6,  0.0,    0.4  } },
+} };
+static const Synth_fm fm_bass = { FM_STACK, 3, 0.6, {
+    { 1.0,  2.0,  { 0.0,   0.25, 0.35,   0.1  } },
+    { 3.0,  0.8,  { 0.0,   0.05, 0.0,    0.05 } },  // pluck
+} };
+
+// one patch per General MIDI family of eight programs
+static const Synth_patch gm_patches[16] = {
+    //  oscillator    FM         curve attack decay sustain release   cutoff env  vel  Q          voice LFO         channel LFO       percussion
+    { OSC_SINE,     &fm_piano, { EXP, 0.002, 2.0,  0.05, 0.3  }, { 0.0, 0.0, 0.0, 0.0,   LP }, NULL,             NULL,             PITCHED },  // piano
+    { OSC_SINE,     &fm_bell,  { EXP, 0.001, 0.8,  0.0,  0.4  }, { 0.0, 0.0, 0.0, 0.0,   LP }, NULL,             NULL,             PITCHED },  // chromatic percussion
+    { OSC_SQUARE,   NULL,      { LIN, 0.005, 0.05, 0.9,  0.08 }, { 6.0, 0.0, 1.0, 0.707, LP }, NULL,             &lfo_rotary,      PITCHED },  // organ
+    { OSC_SAW,      NULL,      { EXP, 0.002, 1.2,  0.05, 0.25 }, { 1.5, 3.0, 1.5, 1.0,   LP }, NULL,             NULL,             PITCHED },  // guitar
+    { OSC_SINE,     &fm_bass,  { EXP, 0.003, 0.6,  0.4,  0.15 }, { 0.0, 0.0, 0.0, 0.0,   LP }, NULL,             NULL,             PITCHED },  // bass
+    { OSC_SAW,      NULL,      { LIN, 0.08,  0.2,  0.8,  0.4  }, { 3.0, 1.5, 1.0, 0.707, LP }, &lfo_vibrato,     NULL,             PITCHED },  // strings
+    { OSC_SAW,      NULL,      { LIN, 0.15,  0.3,  0.7,  0.6  }, { 3.0, 1.5, 1.0, 0.707, LP }, &lfo_vibrato,     &lfo_drift,       PITCHED },  // ensemble
+    { OSC_SAW,      NULL,      { EXP, 0.03,  0.2,  0.7,  0.2  }, { 1.5, 3.0, 1.5, 0.9,   LP }, &lfo_vibrato,     NULL,             PITCHED },  // brass
+    { OSC_SQUARE,   NULL,      { EXP, 0.02,  0.1,  0.8,  0.15 }, { 3.0, 1.5, 1.0, 1.0,   LP }, &lfo_vibrato,     NULL,             PITCHED },  // reed
+    { OSC_TRIANGLE, NULL,      { LIN, 0.04,  0.1,  0.8,  0.2  }, { 0.0, 0.0, 0.0, 0.0,   LP }, &lfo_vibrato,     NULL,             PITCHED },  // pipe
+    { OSC_SAW,      NULL,      { EXP, 0.002, 0.3,  0.3,  0.5  }, { 2.0, 3.0, 1.0, 2.0,   LP }, &lfo_vibrato,     &lfo_sweep,       PITCHED },  // synth lead
+    { OSC_TRIANGLE, NULL,      { LIN, 0.4,   0.5,  0.7,  1.0  }, { 0.0, 0.0, 0.0, 0.0,   LP }, NULL,             &lfo_drift,       PITCHED },  // synth pad
+    { OSC_SQUARE,   NULL,      { EXP, 0.1,   0.8,  0.4,  0.8  }, { 2.0, 2.0, 1.0, 3.0,   LP }, NULL,             &lfo_sample_hold, PITCHED },  // synth effects
+    { OSC_SAW,      NULL,      { EXP, 0.002, 0.8,  0.1,  0.3  }, { 2.0, 3.0, 1.0, 1.0,   LP }, NULL,             NULL,             PITCHED },  // ethnic
+    { OSC_SINE,     NULL,      { EXP, 0.001, 0.3,  0.0,  0.2  }, { 0.0, 0.0, 0.0, 0.0,   LP }, NULL,             NULL,             PITCHED },  // percussive
+    { OSC_SQUARE,   NULL,      { LIN, 0.05,  0.3,  0.5,  0.4  }, { 3.0, 1.0, 1.0, 1.5,   LP }, &lfo_sample_hold, NULL,             PITCHED },  // sound effects
+};
+
+// GM channel 10 plays percussion whatever its program
+#define GM_PERCUSSION_CHANNEL 9
+#define GM_PERCUSSION_PATCH   (&gm_patches[14])
+
+enum
+{
+    DRUM_KICK, DRUM_SNARE, DRUM_STICK, DRUM_CLAP, DRUM_CLOSED_HAT, DRUM_OPEN_HAT, DRUM_TOM, DRUM_CRASH,
+    DRUM_RIDE, DRUM_COWBELL, DRUM_SHAKER, DRUM_WOOD, DRUM_WHISTLE, DRUM_SCRAPE, DRUM_TRIANGLE, DRUM_MUTE_TRIANGLE
+};
+
+// the percussion kit: pitch-swept tones and filtered noise. Drums ignore how
+// long the key is held, so release matches decay and a note-off changes little
+static const Synth_patch gm_drums[] = {
+    //  oscillator    FM    curve attack  decay sustain release  cutoff env  vel  Q    response           pitch   sweep time   noise
+    { OSC_SINE,     NULL, { EXP, 0.001,  0.35, 0.0, 0.35 }, { 0.0,  0.0, 0.0, 0.0,   LP }, NULL, NULL, { 50.0,   3.5, 0.025, 0.0  } },  // kick
+    { OSC_TRIANGLE, NULL, { EXP, 0.001,  0.2,  0.0, 0.2  }, { 25.0, 1.0, 1.0, 0.707, LP }, NULL, NULL, { 190.0,  1.4, 0.015, 0.65 } },  // snare
+    { OSC_TRIANGLE, NULL, { EXP, 0.0005, 0.05, 0.0, 0.05 }, { 4.0,  0.0, 0.5, 2.0,   BP }, NULL, NULL, { 450.0,  1.2, 0.005, 0.3  } },  // side stick
+    { OSC_SINE,     NULL, { EXP, 0.002,  0.18, 0.0, 0.18 }, { 1.0,  0.0, 0.5, 1.5,   BP }, NULL, NULL, { 1200.0, 1.0, 0.0,   1.0  } },  // clap
+    { OSC_SINE,     NULL, { EXP, 0.0005, 0.06, 0.0, 0.06 }, { 1.0,  0.0, 0.5, 0.707, HP }, NULL, NULL, { 7000.0, 1.0, 0.0,   1.0  } },  // closed hi-hat
+    { OSC_SINE,     NULL, { EXP, 0.0005, 0.45, 0.0, 0.45 }, { 1.0,  0.0, 0.5, 0.707, HP }, NULL, NULL, { 7000.0, 1.0, 0.0,   1.0  } },  // open hi-hat
+    { OSC_SINE,     NULL, { EXP, 0.001,  0.45, 0.0, 0.45 }, { 0.0,  0.0, 0.0, 0.0,   LP }, NULL, NULL, { 0.0,    1.5, 0.06,  0.08 } },  // tom
+    { OSC_SINE,     NULL, { EXP, 0.002,  1.8,  0.0, 1.8  }, { 1.0,  0.0, 0.5, 0.707, HP }, NULL, NULL, { 4500.0, 1.0, 0.0,   1.0  } },  // crash
+    { OSC_SQUARE,   NULL, { EXP, 0.001,  1.2,  0.0, 1.2  }, { 6.0,  0.0, 0.5, 0.707, HP }, NULL, NULL, { 620.0,  1.0, 0.0,   0.85 } },  // ride
+    { OSC_SQUARE,   NULL, { EXP, 0.001,  0.3,  0.0, 0.3  }, { 1.5,  0.0, 0.0, 2.0,   BP }, NULL, NULL, { 560.0,  1.0, 0.0,   0.0  } },  // cowbell
+    { OSC_SINE,     NULL, { EXP, 0.002,  0.12, 0.0, 0.12 }, { 1.0,  0.0, 0.5, 0.707, HP }, NULL, NULL, { 6000.0, 1.0, 0.0,   1.0  } },  // shaker
+    { OSC_TRIANGLE, NULL, { EXP, 0.0005, 0.06, 0.0, 0.06 }, { 0.0,  0.0, 0.0, 0.0,   LP }, NULL, NULL, { 0.0,    1.1, 0.005, 0.0  } },  // wood
+    { OSC_SINE,     NULL, { LIN, 0.01,   0.05, 0.8, 0.1  }, { 0.0,  0.0, 0.0, 0.0,   LP }, NULL, NULL, { 0.0,    1.0, 0.0,   0.0  } },  // whistle
+    { OSC_SINE,     NULL, { EXP, 0.005,  0.3,  0.0, 0.3  }, { 1.0,  0.0, 0.5, 1.0,   BP }, NULL, NULL, { 2000.0, 1.0, 0.0,   1.0  } },  // scrape
+    { OSC_SINE,     NULL, { EXP, 0.001,  1.0,  0.0, 1.0  }, { 0.0,  0.0, 0.0, 0.0,   LP }, NULL, NULL, { 0.0,    1.0, 0.0,   0.0  } },  // triangle
+    { OSC_SINE,     NULL, { EXP, 0.001,  0.12, 0.0, 0.12 }, { 0.0,  0.0, 0.0, 0.0,   LP }, NULL, NULL, { 0.0,    1.0, 0.0,   0.0  } },  // mute triangle
+};
+
+#undef LIN
+#undef EXP
+#undef LP
+#undef BP
+#undef HP
+#undef PITCHED
+
+// the kit sound of each GM percussion key from 35, acoustic bass drum, to
+// 81, open triangle
+#define GM_DRUM_FIRST_KEY 35
+
+static const uint8_t gm_drum_keys[] = {
+    DRUM_KICK,     DRUM_KICK,       DRUM_STICK,     DRUM_SNARE,       DRUM_CLAP,     DRUM_SNARE,     // 35
+    DRUM_TOM,      DRUM_CLOSED_HAT, DRUM_TOM,       DRUM_CLOSED_HAT,  DRUM_TOM,      DRUM_OPEN_HAT,  // 41
+    DRUM_TOM,      DRUM_TOM,        DRUM_CRASH,     DRUM_TOM,         DRUM_RIDE,     DRUM_CRASH,     // 47
+    DRUM_RIDE,     DRUM_SHAKER,     DRUM_CRASH,     DRUM_COWBELL,     DRUM_CRASH,    DRUM_SCRAPE,    // 53
+    DRUM_RIDE,     DRUM_TOM,        DRUM_TOM,       DRUM_TOM,         DRUM_TOM,      DRUM_TOM,       // 59
+    DRUM_TOM,      DRUM_TOM,        DRUM_COWBELL,   DRUM_COWBELL,     DRUM_SHAKER,   DRUM_SHAKER,    // 65
+    DRUM_WHISTLE,  DRUM_WHISTLE,    DRUM_SCRAPE,    DRUM_SCRAPE,      DRUM_WOOD,     DRUM_WOOD,      // 71
+    DRUM_WOOD,     DRUM_TOM,        DRUM_TOM,       DRUM_MUTE_TRIANGLE, DRUM_TRIANGLE                // 77
+};
+
+static double patches_max_release_time(const Synth_patch *patches, size_t count, double release)
 {
-    osc->type = type;
-    osc->frequency = frequency;
-    osc->phase = 0.0;
-    osc->phase_increment = frequency / SAMPLE_RATE;
+    for (size_t p = 0; p < count; ++p)
+    {
+        if (patches[p].env.release_time > release)
+            release = patches[p].env.release_time;
+    }
+    return release;
 }
 
-void oscillator_set_frequency(Oscillator *osc, double frequency)
+// FM operator envelopes are not counted: the voice ends with its own
+// release whatever its operators are doing
+double synth_max_release_time(void)
 {
-    osc->frequency = frequency;
-    osc->phase_increment = frequency / SAMPLE_RATE;
+    double release = patches_max_release_time(gm_patches, sizeof(gm_patches) / sizeof(gm_patches[0]), 0.0);
+    return patches_max_release_time(gm_drums, sizeof(gm_drums) / sizeof(gm_drums[0]), release);
 }
 
-float oscillator_next_sample(Oscillator *osc)
+// one allocation for all lanes; capacity is a multiple of SYNTH_LANES so
+// every array starts on a 32-byte boundary
+#define BANK_FLOAT_ARRAYS 19
+#define BANK_MIX_FLOATS   (SYNTH_BLOCK_SIZE * SYNTH_OUTPUT_CHANNELS * SYNTH_LANES)
+#define BANK_INT_ARRAYS   6
+// per FM operator: six float and three int arrays, and a routing weight for
+// each operator below it
+#define BANK_FM_FLOAT_ARRAYS (6 * (FM_OPERATORS - 1) + (FM_OPERATORS - 1) * FM_OPERATORS / 2)
+#define BANK_FM_INT_ARRAYS   (3 * (FM_OPERATORS - 1))
+#define BANK_ALIGN        32
+
+// sustain and idle have no end; env_left is re-armed if it ever runs out
+#define ENV_FOREVER UINT32_MAX
+
+// how far past its target an exponential segment aims, as a fraction of the
+// distance it covers. Attack overshoots a lot for its rounded knee; decay
+// and release are within 60 dB of their target when they reach it
+#define ENV_ATTACK_OVERSHOOT 0.3
+#define ENV_DECAY_OVERSHOOT  0.001
+
+static float envelope_target(const ADSR_Envelope *env, Envelope_state state)
 {
-    float sample = 0.0f;
-    
-    switch (osc->type)
+    switch (state)
     {
-    case OSC_SINE:
-        sample = (float)sin(2.0 * M_PI * osc->phase);
-        break;
+    case ENV_ATTACK:  return 1.0f;
+    case ENV_DECAY:
+    case ENV_SUSTAIN: return (float)env->sustain_level;
+    default:          return 0.0f;
+    }
+}
+
+static double envelope_duration(const ADSR_Envelope *env, Envelope_state state)
+{
+    switch (state)
+    {
+    case ENV_ATTACK:  return env->attack_time;
+    case ENV_DECAY:   return env->decay_time;
+    case ENV_RELEASE: return env->release_time;
+    default:          return 0.0;
+    }
+}
+
+static Envelope_state envelope_next(Envelope_state state)
+{
+    switch (state)
+    {
+    case ENV_ATTACK:  return ENV_DECAY;
+    case ENV_DECAY:   return ENV_SUSTAIN;
+    case ENV_RELEASE: return ENV_IDLE;
+    default:          return state;
+    }
+}
+
+// sets up the recurrence that takes a lane from `from` to `to` in `samples`
+static void voice_bank_set_curve(Voice_bank *bank, size_t v, Envelope_state state,
+                                 double from, double to, double samples)
+{
+    if (bank->voices[v].env.curve == ENV_CURVE_EXPONENTIAL && from != to)
+    {
+        // the distance to `aim` shrinks by `mul` every sample and is
+        // `overshoot / (1 + overshoot)` of what it was after `samples`
+        double overshoot = state == ENV_ATTACK ? ENV_ATTACK_OVERSHOOT : ENV_DECAY_OVERSHOOT;
+        double aim = to + (to - from) * overshoot;
+        double mul = pow(overshoot / (1.0 + overshoot), 1.0 / samples);
+        bank->env_mul[v] = (float)mul;
+        bank->env_add[v] = (float)(aim * (1.0 - mul));
+        return;
+    }
+    bank->env_mul[v] = 1.0f;
+    bank->env_add[v] = (float)((to - from) / samples);
+}
+
+// moves the lane's operator envelopes `samples` along their curves
+static void voice_bank_advance_operators(Voice_bank *bank, size_t v, double samples)
+{
+    for (size_t o = 0; o < FM_OPERATORS - 1; ++o)
+    {
+        double mul = bank->op_mul[o][v];
+        if (mul == 1.0) continue;
         
-    case OSC_SQUARE:
-        sample = osc->phase < 0.5 ? 1.0f : -1.0f;
+        double aim = bank->op_add[o][v] / (1.0 - mul);
+        bank->op_level[o][v] = (float)(aim + (bank->op_level[o][v] - aim) * pow(mul, samples));
+    }
+}
+
+// moves a lane `samples` along its current segment without rendering
+static void voice_bank_advance(Voice_bank *bank, size_t v, uint32_t samples)
+{
+    double mul = bank->env_mul[v];
+    double add = bank->env_add[v];
+    
+    if (mul == 1.0)
+    {
+        bank->level[v] += (float)(add * samples);
+    }
+    else
+    {
+        double aim = add / (1.0 - mul);
+        bank->level[v] = (float)(aim + (bank->level[v] - aim) * pow(mul, samples));
+    }
+    bank->env_left[v] -= samples;
+    voice_bank_advance_operators(bank, v, samples);
+}
+
+// the lane's filter set to pass its input through, with empty state
+static void voice_bank_clear_filter(Voice_bank *bank, size_t v)
+{
+    bank->svf_ic1[v] = bank->svf_ic2[v] = 0.0f;
+    bank->svf_a1[v] = bank->svf_a2[v] = bank->svf_a3[v] = 0.0f;
+    bank->svf_d1[v] = bank->svf_d2[v] = bank->svf_d3[v] = 0.0f;
+    bank->svf_dry[v] = 1.0f;
+    bank->svf_band[v] = bank->svf_low[v] = 0.0f;
+}
+
+// the filtered lane's output as a mix of the filter's input, band and low
+// outputs, k being 1 / Q
+static void voice_bank_set_response(Voice_bank *bank, size_t v, Filter_response response, double k)
+{
+    switch (response)
+    {
+    case FILTER_BANDPASS:
+        // normalised to unity gain at the cutoff
+        bank->svf_dry[v] = 0.0f;
+        bank->svf_band[v] = (float)k;
+        bank->svf_low[v] = 0.0f;
         break;
-        
-    case OSC_SAW:
-        sample = (float)(2.0 * osc->phase - 1.0);
+    case FILTER_HIGHPASS:
+        bank->svf_dry[v] = 1.0f;
+        bank->svf_band[v] = (float)-k;
+        bank->svf_low[v] = -1.0f;
         break;
-        
-    case OSC_TRIANGLE:
-        if (osc->phase < 0.5)
-            sample = (float)(4.0 * osc->phase - 1.0);
-        else
-            sample = (float)(3.0 - 4.0 * osc->phase);
+    default:
+        bank->svf_dry[v] = 0.0f;
+        bank->svf_band[v] = 0.0f;
+        bank->svf_low[v] = 1.0f;
         break;
     }
-    
-    osc->phase += osc->phase_increment;
-    if (osc->phase >= 1.0)
-        osc->phase -= 1.0;
-    
-    return sample;
 }
 
-void envelope_init(ADSR_Envelope *env, double attack, double decay, double sustain, double release)
+// the lane without FM operators; their phases start again from 0
+static void voice_bank_clear_operators(Voice_bank *bank, size_t v)
 {
-    env->attack_time = attack;
-    env->decay_time = decay;
-    env->sustain_level = sustain;
-    env->release_time = release;
-    env->state = ENV_IDLE;
-    env->current_level = 0.0;
-    env->time_in_state = 0.0;
+    for (size_t o = 0; o < FM_OPERATORS - 1; ++o)
+    {
+        bank->op_phase[o][v] = bank->op_inc[o][v] = bank->op_glide[o][v] = 0;
+        bank->op_level[o][v] = bank->op_add[o][v] = 0.0f;
+        bank->op_mul[o][v] = 1.0f;
+        bank->op_feedback[o][v] = bank->op_out[o][v] = bank->op_carrier[o][v] = 0.0f;
+        for (size_t t = 0; t <= o; ++t)
+            bank->op_mod[o][t][v] = 0.0f;
+    }
 }
 
-void envelope_trigger(ADSR_Envelope *env)
+// wires the lane's operators up by the voice's algorithm. They start silent
+// and rise with the attack
+static void voice_bank_route_operators(Voice_bank *bank, size_t v)
 {
-    env->state = ENV_ATTACK;
-    env->time_in_state = 0.0;
+    static const uint8_t targets[FM_ALGORITHM_COUNT][FM_OPERATORS - 1] = {
+#define X(id, op1, op2, op3) [id] = { op1, op2, op3 },
+        FM_ALGORITHMS(X)
+#undef X
+    };
+    const Synth_fm *fm = bank->voices[v].fm;
+    int top = fm->operators - 1;
+    
+    for (int op = 1; op <= top; ++op)
+    {
+        const Synth_operator *oper = &fm->op[op - 1];
+        uint8_t mask = targets[fm->algorithm][op - 1];
+        for (int t = 0; t < op; ++t)
+            bank->op_mod[op - 1][t][v] = mask & (1 << t) ? (float)FM_INDEX_SCALE : 0.0f;
+        bank->op_carrier[op - 1][v] = mask == 0 ? 1.0f : 0.0f;
+        if (op == top && oper->level > 0.0)
+            bank->op_feedback[op - 1][v] = (float)(fm->feedback / oper->level * FM_INDEX_SCALE);
+    }
 }
 
-void envelope_release(ADSR_Envelope *env)
+// operator envelopes aim this fraction of full level below their target, so
+// those falling to silence settle just under it rather than decaying into
+// denormals
+#define FM_ENV_FLOOR 1e-4
+
+// points the lane's operator envelopes where the voice's stage takes them
+static void voice_bank_set_operators(Voice_bank *bank, size_t v, Envelope_state state)
 {
-    if (env->state != ENV_IDLE)
+    const Synth_fm *fm = bank->voices[v].fm;
+    
+    for (int op = 1; op < fm->operators; ++op)
     {
-        env->state = ENV_RELEASE;
-        env->time_in_state = 0.0;
+        const Synth_operator *oper = &fm->op[op - 1];
+        double target, time;
+        switch (state)
+        {
+        case ENV_ATTACK:  target = 1.0;                     time = oper->env.attack;  break;
+        case ENV_RELEASE: target = 0.0;                     time = oper->env.release; break;
+        default:          target = oper->env.sustain_level; time = oper->env.decay;   break;
+        }
+        double mul = time > 0.0 ? exp(-1.0 / (time * SAMPLE_RATE)) : 0.0;
+        bank->op_mul[op - 1][v] = (float)mul;
+        bank->op_add[op - 1][v] = (float)((target - FM_ENV_FLOOR) * oper->level * (1.0 - mul));
     }
 }
 
-float envelope_next_value(ADSR_Envelope *env, double sample_rate)
+// sets the lane's phase increment and glide, and its operators' at their
+// ratios to them
+static void voice_bank_set_pitch(Voice_bank *bank, size_t v, uint32_t inc, uint32_t glide)
 {
-    double dt = 1.0 / sample_rate;
-    env->time_in_state += dt;
+    const Synth_fm *fm = bank->voices[v].fm;
+    
+    bank->phase_inc[v] = inc;
+    bank->phase_glide[v] = glide;
+    if (!fm) return;
     
-    switch (env->state)
+    for (int op = 1; op < fm->operators; ++op)
     {
-    case ENV_IDLE:
-        env->current_level = 0.0;
-        break;
-        
-    case ENV_ATTACK:
-        if (env->attack_time > 0.0)
+        double ratio = fm->op[op - 1].ratio;
+        double op_inc = inc * ratio;
+        double op_glide = (int32_t)glide * ratio;
+        // held at Nyquist, like the oscillator
+        if (op_inc > 2147483648.0)
         {
-            env->current_level = env->time_in_state / env->attack_time;
-            if (env->current_level >= 1.0)
-            {
-                env->current_level = 1.0;
-                env->state = ENV_DECAY;
-                env->time_in_state = 0.0;
-            }
+            op_inc = 2147483648.0;
+            op_glide = 0.0;
         }
-        else
+        bank->op_inc[op - 1][v] = (uint32_t)(op_inc + 0.5);
+        bank->op_glide[op - 1][v] = (uint32_t)(int32_t)floor(op_glide + 0.5);
+    }
+}
+
+// starts a segment at the lane's current level: its curve and its length in
+// samples are worked out here, once
+static void voice_bank_enter(Voice_bank *bank, size_t v, Envelope_state state)
+{
+    Voice *voice = &bank->voices[v];
+    const ADSR_Envelope *env = &voice->env;
+    
+    while (state != ENV_SUSTAIN && state != ENV_IDLE)
+    {
+        double samples = floor(envelope_duration(env, state) * SAMPLE_RATE + 0.5);
+        if (samples >= 1.0)
         {
-            env->current_level = 1.0;
-            env->state = ENV_DECAY;
-            env->time_in_state = 0.0;
+            if (samples > ENV_FOREVER - 1.0) samples = ENV_FOREVER - 1.0;
+            voice->state = state;
+            voice_bank_set_curve(bank, v, state, bank->level[v], envelope_target(env, state), samples);
+            bank->env_left[v] = (uint32_t)samples;
+            if (voice->fm)
+                voice_bank_set_operators(bank, v, state);
+            return;
         }
+        // zero-length segment
+        bank->level[v] = envelope_target(env, state);
+        state = envelope_next(state);
+    }
+    
+    // parked lanes stop their oscillator and drop out of the filtered
+    // kernels
+    if (state == ENV_IDLE)
+    {
+        bank->phase_inc[v] = 0;
+        bank->phase_glide[v] = 0;
+        bank->gain_left_glide[v] = bank->gain_right_glide[v] = 0.0f;
+        bank->noise_mix[v] = 0.0f;
+        voice_bank_clear_filter(bank, v);
+        voice_bank_clear_operators(bank, v);
+    }
+    else if (voice->fm)
+    {
+        voice_bank_set_operators(bank, v, state);
+    }
+    voice->state = state;
+    bank->level[v] = envelope_target(env, state);
+    bank->env_mul[v] = 1.0f;
+    bank->env_add[v] = 0.0f;
+    bank->env_left[v] = ENV_FOREVER;
+}
+
+// called by the kernels when a lane's env_left reaches 0; the segment's last
+// sample lands on the target up to rounding, so snap to it exactly
+void voice_bank_end_segment(Voice_bank *bank, size_t v)
+{
+    Voice *voice = &bank->voices[v];
+    
+    bank->level[v] = envelope_target(&voice->env, voice->state);
+    voice_bank_enter(bank, v, envelope_next(voice->state));
+}
+
+static int voice_bank_init(Voice_bank *bank, size_t voice_count)
+{
+    size_t capacity = (voice_count + SYNTH_LANES - 1) / SYNTH_LANES * SYNTH_LANES;
+    
+    memset(bank, 0, sizeof(Voice_bank));
+    size_t floats = (BANK_FLOAT_ARRAYS + BANK_FM_FLOAT_ARRAYS) * capacity + BANK_MIX_FLOATS;
+    size_t ints = (BANK_INT_ARRAYS + BANK_FM_INT_ARRAYS) * capacity;
+    bank->storage = calloc(floats * sizeof(float) + ints * sizeof(uint32_t) + BANK_ALIGN, 1);
+    bank->voices = calloc(capacity, sizeof(Voice));
+    if (!bank->storage || !bank->voices)
+    {
+        free(bank->storage);
+        free(bank->voices);
+        return 0;
+    }
+    bank->capacity = capacity;
+    
+    float *lanes = (float *)(((uintptr_t)bank->storage + BANK_ALIGN - 1) & ~(uintptr_t)(BANK_ALIGN - 1));
+    float **arrays[BANK_FLOAT_ARRAYS] = {
+        &bank->gain_left, &bank->gain_right, &bank->gain_left_glide, &bank->gain_right_glide,
+        &bank->level, &bank->env_mul, &bank->env_add,
+        &bank->svf_ic1, &bank->svf_ic2, &bank->svf_a1, &bank->svf_a2, &bank->svf_a3,
+        &bank->svf_d1, &bank->svf_d2, &bank->svf_d3, &bank->svf_dry, &bank->svf_band, &bank->svf_low,
+        &bank->noise_mix
+    };
+    for (size_t a = 0; a < BANK_FLOAT_ARRAYS; ++a)
+        *arrays[a] = lanes + a * capacity;
+    
+    float *op_lanes = lanes + BANK_FLOAT_ARRAYS * capacity;
+    for (size_t o = 0; o < FM_OPERATORS - 1; ++o)
+    {
+        float **op_arrays[] = {
+            &bank->op_level[o], &bank->op_mul[o], &bank->op_add[o],
+            &bank->op_feedback[o], &bank->op_out[o], &bank->op_carrier[o]
+        };
+        for (size_t a = 0; a < sizeof(op_arrays) / sizeof(op_arrays[0]); ++a, op_lanes += capacity)
+            *op_arrays[a] = op_lanes;
+        for (size_t t = 0; t <= o; ++t, op_lanes += capacity)
+            bank->op_mod[o][t] = op_lanes;
+    }
+    bank->lane_mix = op_lanes;
+    
+    uint32_t *int_lanes = (uint32_t *)(bank->lane_mix + BANK_MIX_FLOATS);
+    bank->phase = int_lanes;
+    bank->phase_inc = int_lanes + capacity;
+    bank->table = (int32_t *)(int_lanes + 2 * capacity);
+    bank->env_left = int_lanes + 3 * capacity;
+    bank->phase_glide = int_lanes + 4 * capacity;
+    bank->noise = int_lanes + 5 * capacity;
+    for (size_t o = 0; o < FM_OPERATORS - 1; ++o)
+    {
+        bank->op_phase[o] = int_lanes + (BANK_INT_ARRAYS + 3 * o) * capacity;
+        bank->op_inc[o] = int_lanes + (BANK_INT_ARRAYS + 3 * o + 1) * capacity;
+        bank->op_glide[o] = int_lanes + (BANK_INT_ARRAYS + 3 * o + 2) * capacity;
+    }
+    bank->wavetables = wavetables_data();
+    bank->sine_table = wavetable_offset(OSC_SINE, 0.0);
+    
+    for (size_t v = 0; v < capacity; ++v)
+        voice_bank_enter(bank, v, ENV_IDLE);
+    return 1;
+}
+
+// a non-zero xorshift seed that is the same for every render of the song;
+// LFOs and noise lanes take theirs from the note-on's sample in the song
+// and its key, so a note resumed after a seek draws what it drew in the
+// full render
+static uint32_t synth_seed(uint64_t a, uint64_t b)
+{
+    uint32_t x = (uint32_t)(a * 2654435761u) ^ (uint32_t)(b * 2246822519u);
+    return x ? x : 1;
+}
+
+// uniform in [-1, 1)
+static float lfo_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (int32_t)x / 2147483648.0f;
+}
+
+static void lfo_start(const Synth_lfo *lfo, Synth_lfo_state *state, uint32_t seed)
+{
+    state->phase = 0.0;
+    state->random = seed;
+    state->value = lfo && lfo->shape == LFO_SAMPLE_HOLD ? lfo_random(&state->random) : 0.0f;
+}
+
+static void lfo_evaluate(const Synth_lfo *lfo, Synth_lfo_state *state)
+{
+    switch (lfo->shape)
+    {
+    case LFO_SINE:
+        state->value = (float)sin(2.0 * M_PI * state->phase);
         break;
-        
-    case ENV_DECAY:
-        if (env->decay_time > 0.0)
+    case LFO_TRIANGLE:
+    {
+        // in step with the sine: 0, up to 1, down to -1 and back
+        double t = state->phase + 0.25;
+        t -= floor(t);
+        state->value = (float)(1.0 - 4.0 * fabs(t - 0.5));
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// moves the LFO on by `beats` quarter notes; sample and hold draws a new
+// value each time the phase wraps
+static void lfo_advance(const Synth_lfo *lfo, Synth_lfo_state *state, double beats)
+{
+    state->phase += lfo->rate * beats;
+    if (state->phase >= 1.0)
+    {
+        state->phase -= floor(state->phase);
+        if (lfo->shape == LFO_SAMPLE_HOLD)
+            state->value = lfo_random(&state->random);
+    }
+    lfo_evaluate(lfo, state);
+}
+
+// puts the LFO `beat` quarter notes into a cycle that began at the start of
+// the song; sample and hold seeds each cycle's value from the cycle's number
+static void lfo_place(const Synth_lfo *lfo, Synth_lfo_state *state, double beat, uint32_t seed)
+{
+    double cycles = lfo->rate * beat;
+    double whole = floor(cycles);
+    state->phase = cycles - whole;
+    if (lfo->shape == LFO_SAMPLE_HOLD)
+    {
+        state->random = synth_seed((uint64_t)whole, seed);
+        state->value = lfo_random(&state->random);
+    }
+    lfo_evaluate(lfo, state);
+}
+
+Synth_isa synth_detect_isa(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SYNTH_ISA_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SYNTH_ISA_SSE2;
+#endif
+    return SYNTH_ISA_SCALAR;
+}
+
+const char *synth_isa_name(Synth_isa isa)
+{
+    switch (isa)
+    {
+    case SYNTH_ISA_AVX2: return "avx2";
+    case SYNTH_ISA_SSE2: return "sse2";
+    default:             return "scalar";
+    }
+}
+
+// returns 0 if the CPU lacks the requested instruction set
+int synth_set_isa(Synth *synth, Synth_isa isa)
+{
+    if (isa > synth_detect_isa())
+        return 0;
+    
+    switch (isa)
+    {
+    case SYNTH_ISA_AVX2:
+        synth->kernels = voice_kernels_avx2;
+        synth->mixdown = voice_mixdown_avx2;
+        break;
+    case SYNTH_ISA_SSE2:
+        synth->kernels = voice_kernels_sse2;
+        synth->mixdown = voice_mixdown_sse2;
+        break;
+    default:
+        synth->kernels = voice_kernels_scalar;
+        synth->mixdown = voice_mixdown_scalar;
+        break;
+    }
+    synth->isa = isa;
+    return 1;
+}
+
+int synth_init(Synth *synth, size_t voice_count)
+{
+    memset(synth, 0, sizeof(Synth));
+    synth->master_volume = 0.15;
+    
+    if (voice_count == 0) voice_count = 1;
+    if (!wavetables_init(NULL)) return 0;
+    if (!voice_bank_init(&synth->bank, voice_count)) return 0;
+    synth->voice_count = voice_count;
+    
+    size_t groups = synth->bank.capacity / SYNTH_LANES;
+    synth->active = calloc(synth->bank.capacity, sizeof(uint32_t));
+    synth->live_groups = calloc(groups, sizeof(uint32_t));
+    synth->group_voices = calloc(groups, sizeof(uint8_t));
+    synth->free_voices = calloc(voice_count, sizeof(uint32_t));
+    if (!synth->active || !synth->live_groups || !synth->group_voices || !synth->free_voices)
+    {
+        synth_free(synth);
+        return 0;
+    }
+    
+    // pushed in reverse so voice 0 is handed out first
+    for (size_t v = voice_count; v > 0; --v)
+        synth->free_voices[synth->free_count++] = (uint32_t)(v - 1);
+    for (size_t k = 0; k < SYNTH_KEYS; ++k)
+        synth->held[k] = -1;
+    for (size_t c = 0; c < SYNTH_CHANNELS; ++c)
+    {
+        synth->channels[c].expression = 127;
+        synth->channels[c].pitch_bend = 8192;
+        synth->channels[c].bend_semitones = 2;
+        synth->channels[c].rpn_msb = synth->channels[c].rpn_lsb = 127;
+        synth->channels[c].pitch_ratio = 1.0;
+        synth_program_change(synth, (uint8_t)c, 0);
+        synth_control_change(synth, (uint8_t)c, 7, 100);
+        synth_control_change(synth, (uint8_t)c, 10, 64);
+    }
+    
+    synth_set_tempo(synth, 500000);
+    synth_set_isa(synth, synth_detect_isa());
+    return 1;
+}
+
+void synth_free(Synth *synth)
+{
+    if (synth && synth->bank.storage)
+    {
+        free(synth->bank.storage);
+        free(synth->bank.voices);
+        free(synth->active);
+        free(synth->live_groups);
+        free(synth->group_voices);
+        free(synth->free_voices);
+        memset(synth, 0, sizeof(Synth));
+    }
+}
+
+static void synth_activate_voice(Synth *synth, size_t v)
+{
+    Voice *voice = &synth->bank.voices[v];
+    size_t group = v / SYNTH_LANES;
+    
+    voice->active = 1;
+    voice->slot = (uint32_t)synth->active_count;
+    synth->active[synth->active_count++] = (uint32_t)v;
+    if (synth->group_voices[group]++ == 0)
+        synth->live_groups[synth->live_group_count++] = (uint32_t)group;
+}
+
+static void synth_retire_voice(Synth *synth, size_t v)
+{
+    Voice *voices = synth->bank.voices;
+    size_t group = v / SYNTH_LANES;
+    
+    // swap the last active voice into the hole
+    uint32_t last = synth->active[--synth->active_count];
+    synth->active[voices[v].slot] = last;
+    voices[last].slot = voices[v].slot;
+    voices[v].active = 0;
+    synth->free_voices[synth->free_count++] = (uint32_t)v;
+    synth->channels[voices[v].channel].voice_count--;
+    
+    if (--synth->group_voices[group] == 0)
+    {
+        for (size_t g = 0; g < synth->live_group_count; ++g)
         {
-            double decay_progress = env->time_in_state / env->decay_time;
-            env->current_level = 1.0 - (1.0 - env->sustain_level) * decay_progress;
-            if (decay_progress >= 1.0)
+            if (synth->live_groups[g] == group)
             {
-                env->current_level = env->sustain_level;
-                env->state = ENV_SUSTAIN;
-                env->time_in_state = 0.0;
+                synth->live_groups[g] = synth->live_groups[--synth->live_group_count];
+                break;
             }
         }
-        else
+    }
+}
+
+#define SYNTH_KEY(channel, note) (((channel) & (SYNTH_CHANNELS - 1)) * 128 + ((note) & 127))
+
+static void synth_hold_voice(Synth *synth, size_t v)
+{
+    Voice *voices = synth->bank.voices;
+    int32_t *head = &synth->held[SYNTH_KEY(voices[v].channel, voices[v].midi_note)];
+    
+    voices[v].held = 1;
+    voices[v].key_prev = -1;
+    voices[v].key_next = *head;
+    if (*head >= 0)
+        voices[*head].key_prev = (int32_t)v;
+    *head = (int32_t)v;
+}
+
+static void synth_unhold_voice(Synth *synth, size_t v)
+{
+    Voice *voices = synth->bank.voices;
+    Voice *voice = &voices[v];
+    
+    if (voice->key_prev >= 0)
+        voices[voice->key_prev].key_next = voice->key_next;
+    else
+        synth->held[SYNTH_KEY(voice->channel, voice->midi_note)] = voice->key_next;
+    if (voice->key_next >= 0)
+        voices[voice->key_next].key_prev = voice->key_prev;
+    voice->held = 0;
+}
+
+// a voice's loudness for stealing is where its envelope is or is heading,
+// whichever is louder, so a note still in its attack is not taken for quiet
+static float synth_steal_loudness(const Synth *synth, size_t v)
+{
+    const Voice_bank *bank = &synth->bank;
+    float target = envelope_target(&bank->voices[v].env, bank->voices[v].state);
+    float level = bank->level[v] > target ? bank->level[v] : target;
+    return level * (bank->gain_left[v] + bank->gain_right[v]);
+}
+
+// The quietest voice, or the quietest of `channel` unless it is negative;
+// ties go to the oldest. Levels move every sample, so an ordered structure
+// would need every voice re-keyed each block: a scan of the active list
+// costs about what one sample of rendering does and only runs when the
+// pool or a channel is full.
+static size_t synth_steal_voice(Synth *synth, int channel)
+{
+    Voice *voices = synth->bank.voices;
+    size_t best = synth->voice_count;
+    float best_level = 0.0f;
+    
+    for (size_t i = 0; i < synth->active_count; ++i)
+    {
+        size_t v = synth->active[i];
+        if (channel >= 0 && voices[v].channel != channel)
+            continue;
+        float level = synth_steal_loudness(synth, v);
+        if (best == synth->voice_count || level < best_level ||
+            (level == best_level && voices[v].started < voices[best].started))
         {
-            env->current_level = env->sustain_level;
-            env->state = ENV_SUSTAIN;
-            env->time_in_state = 0.0;
+            best = v;
+            best_level = level;
         }
-        break;
-        
-    case ENV_SUSTAIN:
-        env->current_level = env->sustain_level;
-        break;
-        
-    case ENV_RELEASE:
-        if (env->release_time > 0.0)
+    }
+    if (voices[best].held)
+        synth_unhold_voice(synth, best);
+    return best;
+}
+
+static size_t synth_alloc_voice(Synth *synth, uint8_t channel)
+{
+    const Synth_channel *ch = &synth->channels[channel];
+    
+    if (ch->voice_limit > 0 && ch->voice_count >= ch->voice_limit)
+        return synth_steal_voice(synth, channel);
+    if (synth->free_count == 0)
+        return synth_steal_voice(synth, -1);
+    return synth->free_voices[--synth->free_count];
+}
+
+// the voice's phase increment under a channel pitch factor, held below
+// Nyquist
+static uint32_t synth_bent_inc(const Voice *voice, double ratio)
+{
+    double inc = voice->base_inc * ratio;
+    if (inc > 0.5) inc = 0.5;
+    return (uint32_t)(inc * 4294967296.0 + 0.5);
+}
+
+// cutoffs above this fraction of the sample rate are held there, where the
+// prewarped coefficients are still well behaved
+#define FILTER_MAX_CUTOFF 0.45
+#define FILTER_MIN_CUTOFF (20.0 / SAMPLE_RATE)
+
+// a voice's filter is only worked out again once its cutoff has moved this
+// far, in octaves; the per-sample ramps hide the steps
+#define FILTER_RETUNE_OCTAVES (1.0 / 48.0)
+
+// works out the voice's filter coefficients for its current envelope level and
+// pitch, and has the lane ramp to them over `frame_count` samples; 0 jumps.
+// This is the only tan() the filter costs: one per voice per block at most
+static void synth_update_filter(Synth *synth, size_t v, size_t frame_count)
+{
+    Voice_bank *bank = &synth->bank;
+    Voice *voice = &bank->voices[v];
+    const Synth_filter *filter = &voice->filter;
+    const Synth_channel *ch = &synth->channels[voice->channel];
+    uint32_t inc = bank->phase_inc[v];
+    double swing = filter->env_octaves * bank->level[v] + filter->velocity_octaves * voice->velocity / 127.0;
+    if (voice->lfo)
+        swing += voice->lfo->cutoff * voice->lfo_state.value;
+    if (ch->patch->channel_lfo)
+        swing += ch->patch->channel_lfo->cutoff * ch->lfo.value;
+    float octaves = (float)swing;
+    
+    if (frame_count > 0 && inc == voice->filter_inc &&
+        fabsf(octaves - voice->filter_octaves) < FILTER_RETUNE_OCTAVES)
+    {
+        bank->svf_d1[v] = bank->svf_d2[v] = bank->svf_d3[v] = 0.0f;
+        return;
+    }
+    voice->filter_octaves = octaves;
+    voice->filter_inc = inc;
+    
+    double cutoff = inc / 4294967296.0 * filter->cutoff * exp2(octaves);
+    if (cutoff > FILTER_MAX_CUTOFF) cutoff = FILTER_MAX_CUTOFF;
+    if (cutoff < FILTER_MIN_CUTOFF) cutoff = FILTER_MIN_CUTOFF;
+    
+    double g = tan(M_PI * cutoff);
+    double k = 1.0 / filter->resonance;
+    double a1 = 1.0 / (1.0 + g * (g + k));
+    double a2 = g * a1;
+    double a3 = g * a2;
+    
+    if (frame_count == 0)
+    {
+        bank->svf_a1[v] = (float)a1;
+        bank->svf_a2[v] = (float)a2;
+        bank->svf_a3[v] = (float)a3;
+        bank->svf_d1[v] = bank->svf_d2[v] = bank->svf_d3[v] = 0.0f;
+        return;
+    }
+    bank->svf_d1[v] = (float)((a1 - bank->svf_a1[v]) / frame_count);
+    bank->svf_d2[v] = (float)((a2 - bank->svf_a2[v]) / frame_count);
+    bank->svf_d3[v] = (float)((a3 - bank->svf_a3[v]) / frame_count);
+}
+
+// GM channel 10 plays a kit sound per key; keys outside the kit and every
+// other channel play the channel's program
+static const Synth_patch *synth_voice_patch(const Synth_channel *ch, uint8_t channel, uint8_t note)
+{
+    if (channel == GM_PERCUSSION_CHANNEL && note >= GM_DRUM_FIRST_KEY &&
+        note < GM_DRUM_FIRST_KEY + sizeof(gm_drum_keys))
+        return &gm_drums[gm_drum_keys[note - GM_DRUM_FIRST_KEY]];
+    return ch->patch;
+}
+
+// everything the note needs is resolved here, so rendering never looks at
+// the channel or the patch. `started` is the note-on's sample in the song
+static size_t synth_start_voice(Synth *synth, uint8_t channel, uint8_t note, uint8_t velocity, uint64_t started)
+{
+    Voice_bank *bank = &synth->bank;
+    channel &= SYNTH_CHANNELS - 1;
+    Synth_channel *ch = &synth->channels[channel];
+    const Synth_patch *patch = synth_voice_patch(ch, channel, note);
+    const Synth_percussion *perc = &patch->percussion;
+    size_t v = synth_alloc_voice(synth, channel);
+    Voice *voice = &bank->voices[v];
+    uint32_t seed = synth_seed(started, SYNTH_KEY(channel, note));
+    
+    if (voice->active)
+        synth->channels[voice->channel].voice_count--;
+    else
+        synth_activate_voice(synth, v);
+    ch->voice_count++;
+    
+    voice->channel = channel;
+    voice->midi_note = note;
+    voice->velocity = velocity;
+    voice->started = started;
+    voice->env = patch->env;
+    voice->osc = patch->osc;
+    voice->fm = patch->fm;
+    voice->filter = patch->filter;
+    voice->lfo = patch->voice_lfo;
+    lfo_start(voice->lfo, &voice->lfo_state, seed);
+    voice->note_gain = velocity / 127.0f;
+    voice->pan_angle = ch->pan_angle;
+    voice->pan_left = ch->pan_left;
+    voice->pan_right = ch->pan_right;
+    voice->base_inc = (perc->pitch > 0.0 ? perc->pitch : midi_note_to_frequency(note)) / SAMPLE_RATE;
+    voice->sweep = perc->sweep > 1.0 ? perc->sweep : 1.0;
+    voice->sweep_samples = perc->sweep_time * SAMPLE_RATE;
+    synth_hold_voice(synth, v);
+    voice_bank_clear_operators(bank, v);
+    // every note starts its oscillator, and an FM voice its operators, from
+    // 0, so a note sounds the same whichever lane it lands on
+    bank->phase[v] = 0;
+    if (voice->fm)
+        voice_bank_route_operators(bank, v);
+    voice_bank_set_pitch(bank, v, synth_bent_inc(voice, ch->pitch_ratio * voice->sweep), 0);
+    bank->table[v] = wavetable_offset(voice->osc, bank->phase_inc[v] / 4294967296.0);
+    bank->gain_left[v] = voice->note_gain * ch->gain * voice->pan_left;
+    bank->gain_right[v] = voice->note_gain * ch->gain * voice->pan_right;
+    bank->gain_left_glide[v] = bank->gain_right_glide[v] = 0.0f;
+    bank->noise[v] = seed;
+    bank->noise_mix[v] = (float)perc->noise;
+    voice_bank_clear_filter(bank, v);
+    voice_bank_enter(bank, v, ENV_ATTACK);
+    if (voice->filter.cutoff > 0.0 && voice->state != ENV_IDLE)
+    {
+        voice_bank_set_response(bank, v, voice->filter.response, 1.0 / voice->filter.resonance);
+        synth_update_filter(synth, v, 0);
+    }
+    return v;
+}
+
+void synth_note_on(Synth *synth, uint8_t channel, uint8_t note, uint8_t velocity)
+{
+    synth_start_voice(synth, channel, note, velocity, synth->clock);
+}
+
+// puts a held voice where it would be `age_samples` after its note-on
+void synth_resume_note(Synth *synth, uint8_t channel, uint8_t note, uint8_t velocity, uint64_t age_samples)
+{
+    Voice_bank *bank = &synth->bank;
+    size_t v = synth_start_voice(synth, channel, note, velocity, synth->clock - age_samples);
+    Voice *voice = &bank->voices[v];
+    
+    bank->phase[v] = (uint32_t)(age_samples * bank->phase_inc[v]);
+    for (size_t o = 0; o < FM_OPERATORS - 1; ++o)
+        bank->op_phase[o][v] = (uint32_t)(age_samples * bank->op_inc[o][v]);
+    if (voice->lfo)
+        lfo_advance(voice->lfo, &voice->lfo_state, age_samples * synth->beats_per_sample);
+    // a noise lane steps once a sample, the way vk_noise does
+    if (bank->noise_mix[v] != 0.0f)
+    {
+        uint32_t x = bank->noise[v];
+        for (uint64_t i = 0; i < age_samples; ++i)
         {
-            double release_level = env->current_level * (1.0 - env->time_in_state / env->release_time);
-            if (release_level <= 0.0)
-            {
-                env->current_level = 0.0;
-                env->state = ENV_IDLE;
-            }
-            else
-            {
-                env->current_level = release_level;
-            }
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
         }
-        else
+        bank->noise[v] = x;
+    }
+    // skip whole segments, then move along the one the note is in
+    while (voice->state != ENV_SUSTAIN && voice->state != ENV_IDLE)
+    {
+        uint32_t left = bank->env_left[v];
+        if (age_samples < left)
         {
-            env->current_level = 0.0;
-            env->state = ENV_IDLE;
+            voice_bank_advance(bank, v, (uint32_t)age_samples);
+            return;
         }
-        break;
+        age_samples -= left;
+        voice_bank_advance_operators(bank, v, left);
+        voice_bank_end_segment(bank, v);
     }
-    
-    return (float)env->current_level;
+    // operator envelopes still settle while the voice sustains
+    voice_bank_advance_operators(bank, v, (double)age_samples);
 }
 
-void synth_init(Synth *synth)
+// releases every voice holding the key
+void synth_note_off(Synth *synth, uint8_t channel, uint8_t note)
 {
-    memset(synth, 0, sizeof(Synth));
-    synth->master_volume = 0.15;
+    int32_t *head = &synth->held[SYNTH_KEY(channel, note)];
     
-    for (int i = 0; i < MAX_VOICES; ++i)
+    while (*head >= 0)
     {
-        oscillator_init(&synth->voices[i].osc, OSC_SAW, 440.0);
-        envelope_init(&synth->voices[i].env, 0.002, 0.3, 0.3, 0.5);
-        synth->voices[i].active = 0;
+        size_t v = (size_t)*head;
+        synth_unhold_voice(synth, v);
+        voice_bank_enter(&synth->bank, v, ENV_RELEASE);
     }
 }
 
-void synth_note_on(Synth *synth, uint8_t note, uint8_t velocity)
+void synth_program_change(Synth *synth, uint8_t channel, uint8_t program)
 {
-    int free_voice = -1;
-    for (int i = 0; i < MAX_VOICES; ++i)
+    channel &= SYNTH_CHANNELS - 1;
+    Synth_channel *ch = &synth->channels[channel];
+    
+    ch->program = program & 127;
+    if (channel == GM_PERCUSSION_CHANNEL)
+        ch->patch = GM_PERCUSSION_PATCH;
+    else
+        ch->patch = &gm_patches[ch->program >> 3];
+}
+
+// volume and expression follow the GM curve of 40 log10(value / 127) dB
+void synth_control_change(Synth *synth, uint8_t channel, uint8_t controller, uint8_t value)
+{
+    Voice_bank *bank = &synth->bank;
+    channel &= SYNTH_CHANNELS - 1;
+    Synth_channel *ch = &synth->channels[channel];
+    
+    value &= 127;
+    switch (controller)
+    {
+    case 1:  ch->modulation = value; return;
+    case 7:  ch->volume = value; break;
+    case 10:
+    {
+        // constant power, hard left at 0 and 1, centre at 64, hard right at 127
+        double angle = (value > 1 ? value - 1 : 0) * (M_PI / 2.0 / 126.0);
+        ch->pan = value;
+        ch->pan_angle = (float)angle;
+        ch->pan_left = (float)cos(angle);
+        ch->pan_right = (float)sin(angle);
+        return;
+    }
+    case 11: ch->expression = value; break;
+    
+    // registered parameters; only RPN 0, the bend range, is acted on
+    case 101: ch->rpn_msb = value; return;
+    case 100: ch->rpn_lsb = value; return;
+    case 99:
+    case 98:  ch->rpn_msb = ch->rpn_lsb = 127; return;
+    case 6:
+        if (ch->rpn_msb == 0 && ch->rpn_lsb == 0)
+            ch->bend_semitones = value;
+        return;
+    case 38:
+        if (ch->rpn_msb == 0 && ch->rpn_lsb == 0)
+            ch->bend_cents = value;
+        return;
+    default: return;
+    }
+    
+    float volume = ch->volume / 127.0f;
+    float expression = ch->expression / 127.0f;
+    ch->gain = volume * volume * expression * expression;
+    
+    // sounding voices take the new gain from the next block on
+    for (size_t i = 0; i < synth->active_count; ++i)
     {
-        if (!synth->voices[i].active)
+        size_t v = synth->active[i];
+        const Voice *voice = &bank->voices[v];
+        if (voice->channel == channel)
         {
-            free_voice = i;
-            break;
+            bank->gain_left[v] = voice->note_gain * ch->gain * voice->pan_left;
+            bank->gain_right[v] = voice->note_gain * ch->gain * voice->pan_right;
         }
     }
+}
+
+// takes effect from the next block
+void synth_pitch_bend(Synth *synth, uint8_t channel, uint16_t bend)
+{
+    synth->channels[channel & (SYNTH_CHANNELS - 1)].pitch_bend = bend & 0x3FFF;
+}
+
+// what RPN 0 sets, for restoring a channel without replaying its data entry
+void synth_set_bend_range(Synth *synth, uint8_t channel, uint8_t semitones, uint8_t cents)
+{
+    Synth_channel *ch = &synth->channels[channel & (SYNTH_CHANNELS - 1)];
+    ch->bend_semitones = semitones & 127;
+    ch->bend_cents = cents & 127;
+}
+
+void synth_set_voice_limit(Synth *synth, uint8_t channel, size_t limit)
+{
+    synth->channels[channel & (SYNTH_CHANNELS - 1)].voice_limit = limit;
+}
+
+#define VIBRATO_RATE  5.5
+// cents at full modulation
+#define VIBRATO_DEPTH 50.0
+
+// LFO rates follow the new tempo from the next block
+void synth_set_tempo(Synth *synth, uint32_t us_per_qn)
+{
+    if (us_per_qn == 0) us_per_qn = 500000;
+    synth->beats_per_sample = 1e6 / ((double)us_per_qn * SAMPLE_RATE);
+}
+
+// for a render that starts part way into the song: the notes resumed after
+// this count their age back from `sample`, and the channel LFOs of the
+// programs already set stand where they do `beat` quarter notes in
+void synth_set_clock(Synth *synth, uint64_t sample, double beat)
+{
+    synth->clock = sample;
+    synth->beat = beat;
+    for (size_t c = 0; c < SYNTH_CHANNELS; ++c)
+    {
+        Synth_channel *ch = &synth->channels[c];
+        if (ch->patch->channel_lfo)
+            lfo_place(ch->patch->channel_lfo, &ch->lfo, beat, synth_seed(c, 0));
+    }
+}
+
+// moves the channel LFOs and those of the sounding voices to where they are
+// at the end of the coming block
+static void synth_update_lfos(Synth *synth, size_t frame_count)
+{
+    double beats = frame_count * synth->beats_per_sample;
+    
+    for (size_t c = 0; c < SYNTH_CHANNELS; ++c)
+    {
+        Synth_channel *ch = &synth->channels[c];
+        if (ch->patch->channel_lfo)
+            lfo_place(ch->patch->channel_lfo, &ch->lfo, synth->beat + beats, synth_seed(c, 0));
+    }
+    for (size_t i = 0; i < synth->active_count; ++i)
+    {
+        Voice *voice = &synth->bank.voices[synth->active[i]];
+        if (voice->lfo)
+            lfo_advance(voice->lfo, &voice->lfo_state, beats);
+    }
+}
+
+// evaluates every channel's pitch factor for the end of the coming block.
+// Voices of channels whose factor moved glide to it linearly across the
+// block; channels that stopped moving snap their voices onto it. Voices with
+// a pitch LFO or a percussion sweep of their own glide every block
+static void synth_update_pitch(Synth *synth, size_t frame_count)
+{
+    Voice_bank *bank = &synth->bank;
+    int update[SYNTH_CHANNELS];
     
-    if (free_voice == -1)
+    for (size_t c = 0; c < SYNTH_CHANNELS; ++c)
     {
-        for (int i = 0; i < MAX_VOICES; ++i)
+        Synth_channel *ch = &synth->channels[c];
+        double range = ch->bend_semitones + ch->bend_cents / 100.0;
+        double cents = (ch->pitch_bend - 8192) / 8192.0 * range * 100.0;
+        if (ch->modulation > 0)
         {
-            if (synth->voices[i].env.state == ENV_RELEASE || 
-                synth->voices[i].env.state == ENV_IDLE)
-            {
-                free_voice = i;
-                break;
-            }
+            double phase = (double)(synth->clock + frame_count) * VIBRATO_RATE / SAMPLE_RATE;
+            phase -= floor(phase);
+            cents += ch->modulation / 127.0 * VIBRATO_DEPTH * sin(2.0 * M_PI * phase);
         }
+        if (ch->patch->channel_lfo)
+            cents += ch->patch->channel_lfo->pitch * ch->lfo.value;
+        double ratio = cents != 0.0 ? pow(2.0, cents / 1200.0) : 1.0;
+        
+        int moved = ratio != ch->pitch_ratio;
+        update[c] = moved || ch->gliding;
+        ch->pitch_ratio = ratio;
+        ch->gliding = moved;
+    }
+    
+    for (size_t i = 0; i < synth->active_count; ++i)
+    {
+        size_t v = synth->active[i];
+        Voice *voice = &bank->voices[v];
+        const Synth_channel *ch = &synth->channels[voice->channel];
+        int wobbling = voice->lfo && voice->lfo->pitch != 0.0;
+        int sweeping = voice->sweep > 1.0;
+        // a sweep that settled last block still has its glide to stop
+        if ((!update[voice->channel] && !wobbling && !sweeping && bank->phase_glide[v] == 0) ||
+            voice->state == ENV_IDLE)
+            continue;
         
-        if (free_voice == -1)
+        double ratio = ch->pitch_ratio;
+        if (wobbling)
+            ratio *= pow(2.0, voice->lfo->pitch * voice->lfo_state.value / 1200.0);
+        if (sweeping)
         {
-            free_voice = 0;
+            double age = (double)(synth->clock + frame_count - voice->started);
+            double sweep = (voice->sweep - 1.0) * exp(-age / voice->sweep_samples);
+            // settled once within a fiftieth of a cent
+            if (sweep < 1e-5)
+                voice->sweep = 1.0;
+            else
+                ratio *= 1.0 + sweep;
+        }
+        uint32_t target = synth_bent_inc(voice, ratio);
+        uint32_t current = bank->phase_inc[v];
+        if (ch->gliding || wobbling || sweeping)
+        {
+            int64_t step = ((int64_t)target - (int64_t)current) / (int64_t)frame_count;
+            voice_bank_set_pitch(bank, v, current, (uint32_t)step);
         }
+        else
+        {
+            voice_bank_set_pitch(bank, v, target, 0);
+            current = target;
+        }
+        // the table for the higher end of the glide, so it never aliases
+        bank->table[v] = wavetable_offset(voice->osc, (target > current ? target : current) / 4294967296.0);
     }
-    
-    Voice *v = &synth->voices[free_voice];
-    v->midi_note = note;
-    v->velocity = velocity;
-    v->active = 1;
-    
-    double freq = midi_note_to_frequency(note);
-    oscillator_set_frequency(&v->osc, freq);
-    envelope_trigger(&v->env);
 }
 
-void synth_note_off(Synth *synth, uint8_t note)
+// voices under an amplitude or pan LFO ramp their gains across the block to
+// where the LFOs leave them; the others hold the gains of their note-on
+static void synth_update_gains(Synth *synth, size_t frame_count)
 {
-    for (int i = 0; i < MAX_VOICES; ++i)
+    Voice_bank *bank = &synth->bank;
+    
+    for (size_t i = 0; i < synth->active_count; ++i)
     {
-        Voice *v = &synth->voices[i];
-        if (v->active && v->midi_note == note)
+        size_t v = synth->active[i];
+        const Voice *voice = &bank->voices[v];
+        const Synth_channel *ch = &synth->channels[voice->channel];
+        const Synth_lfo *lfos[2] = { voice->lfo, ch->patch->channel_lfo };
+        const Synth_lfo_state *states[2] = { &voice->lfo_state, &ch->lfo };
+        double amp = 1.0;
+        double angle = voice->pan_angle;
+        int moving = 0;
+        
+        for (size_t l = 0; l < 2; ++l)
         {
-            envelope_release(&v->env);
+            if (!lfos[l] || (lfos[l]->amp == 0.0 && lfos[l]->pan == 0.0))
+                continue;
+            amp *= 1.0 - lfos[l]->amp * (1.0 + states[l]->value) / 2.0;
+            angle += lfos[l]->pan * states[l]->value * (M_PI / 4.0);
+            moving = 1;
+        }
+        
+        if (!moving || voice->state == ENV_IDLE)
+        {
+            if (bank->gain_left_glide[v] != 0.0f || bank->gain_right_glide[v] != 0.0f)
+            {
+                bank->gain_left[v] = voice->note_gain * ch->gain * voice->pan_left;
+                bank->gain_right[v] = voice->note_gain * ch->gain * voice->pan_right;
+                bank->gain_left_glide[v] = bank->gain_right_glide[v] = 0.0f;
+            }
+            continue;
         }
+        
+        if (angle < 0.0) angle = 0.0;
+        if (angle > M_PI / 2.0) angle = M_PI / 2.0;
+        double gain = voice->note_gain * ch->gain * amp;
+        bank->gain_left_glide[v] = (float)((gain * cos(angle) - bank->gain_left[v]) / frame_count);
+        bank->gain_right_glide[v] = (float)((gain * sin(angle) - bank->gain_right[v]) / frame_count);
+    }
+}
+
+// the filter follows the envelope and pitch as they stood at the start of the
+// block, a block late at most
+static void synth_update_filters(Synth *synth, size_t frame_count)
+{
+    for (size_t i = 0; i < synth->active_count; ++i)
+    {
+        size_t v = synth->active[i];
+        if (synth->bank.voices[v].filter.cutoff > 0.0)
+            synth_update_filter(synth, v, frame_count);
     }
 }
 
 void synth_render(Synth *synth, float *buffer, size_t frame_count)
 {
-    memset(buffer, 0, frame_count * sizeof(float));
+    Voice *voices = synth->bank.voices;
+    float *lane_mix = synth->bank.lane_mix;
+    float master = (float)synth->master_volume;
     
-    for (size_t i = 0; i < frame_count; ++i)
+    while (frame_count > 0)
     {
-        float mix = 0.0f;
-        int active_voices = 0;
+        size_t n = frame_count < SYNTH_BLOCK_SIZE ? frame_count : SYNTH_BLOCK_SIZE;
+        memset(lane_mix, 0, n * SYNTH_OUTPUT_CHANNELS * SYNTH_LANES * sizeof(float));
+        synth_update_lfos(synth, n);
+        synth_update_pitch(synth, n);
+        synth_update_gains(synth, n);
+        synth_update_filters(synth, n);
         
-        for (int v = 0; v < MAX_VOICES; ++v)
+        // one kernel call per lane group that has a sounding voice
+        for (size_t g = 0; g < synth->live_group_count; )
         {
-            Voice *voice = &synth->voices[v];
+            size_t first = (size_t)synth->live_groups[g] * SYNTH_LANES;
             
-            if (voice->active)
+            // the envelopes only change stage inside a block while some
+            // lane is ramping, pitches and gains only move while some lane
+            // glides, and the filter, noise and operators only run for
+            // groups with a voice that uses them
+            int features = 0;
+            for (size_t v = first; v < first + SYNTH_LANES; ++v)
             {
-                float osc_sample = oscillator_next_sample(&voice->osc);
-                float env_value = envelope_next_value(&voice->env, SAMPLE_RATE);
-                float velocity_scale = voice->velocity / 127.0f;
-                
-                mix += osc_sample * env_value * velocity_scale;
-                active_voices++;
-                
-                if (voice->env.state == ENV_IDLE)
-                {
-                    voice->active = 0;
-                }
+                if (voices[v].state != ENV_SUSTAIN && voices[v].state != ENV_IDLE)
+                    features |= VK_ENVELOPE;
+                if (synth->bank.phase_glide[v] != 0 || synth->bank.gain_left_glide[v] != 0.0f ||
+                    synth->bank.gain_right_glide[v] != 0.0f)
+                    features |= VK_GLIDE;
+                if (synth->bank.svf_band[v] != 0.0f || synth->bank.svf_low[v] != 0.0f)
+                    features |= VK_FILTER;
+                if (synth->bank.noise_mix[v] != 0.0f)
+                    features |= VK_NOISE;
+                if (voices[v].fm && voices[v].state != ENV_IDLE)
+                    features |= VK_FM;
             }
+            synth->kernels[features](&synth->bank, first, lane_mix, n);
+            
+            // retiring the group's last voice moves another group into
+            // slot g, which still has to be rendered
+            size_t live = synth->live_group_count;
+            for (size_t v = first; v < first + SYNTH_LANES; ++v)
+            {
+                if (voices[v].active && voices[v].state == ENV_IDLE)
+                    synth_retire_voice(synth, v);
+            }
+            if (synth->live_group_count == live)
+                ++g;
         }
         
-        float output = mix * (float)synth->master_volume;
-        
-        if (output > 1.0f) output = 1.0f;
-        if (output < -1.0f) output = -1.0f;
+        synth->mixdown(lane_mix, buffer, n, master);
         
-        buffer[i] = output;
+        buffer += n * SYNTH_OUTPUT_CHANNELS;
+        frame_count -= n;
+        synth->clock += n;
+        synth->beat += n * synth->beats_per_sample;
     }
 }
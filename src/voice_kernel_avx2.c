@@ -0,0 +1,7 @@
+// built with -mavx2, only dispatched to when the CPU reports AVX2
+#if defined(__AVX2__)
+#define VK_USE_AVX2
+#endif
+#define VOICE_KERNELS voice_kernels_avx2
+#define VOICE_MIXDOWN voice_mixdown_avx2
+#include "voice_kernel.inc"
@@ -0,0 +1,4 @@
+// built with -fno-tree-vectorize; the fallback on CPUs without SSE2/AVX2
+#define VOICE_KERNELS voice_kernels_scalar
+#define VOICE_MIXDOWN voice_mixdown_scalar
+#include "voice_kernel.inc"
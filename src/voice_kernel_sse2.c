@@ -0,0 +1,7 @@
+// built for the x86-64 baseline, each lane group is two SSE registers
+#if defined(__SSE2__)
+#define VK_USE_SSE2
+#endif
+#define VOICE_KERNELS voice_kernels_sse2
+#define VOICE_MIXDOWN voice_mixdown_sse2
+#include "voice_kernel.inc"
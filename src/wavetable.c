@@ -0,0 +1,183 @@
+#include "wavetable.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// every Oscillator_type gets WAVETABLE_LEVELS band-limited tables, one per
+// octave; sine has a single harmonic so its levels are all the same
+#define WAVETABLE_COUNT   OSC_COUNT
+#define WAVETABLE_FLOATS  ((size_t)WAVETABLE_COUNT * WAVETABLE_LEVELS * WAVETABLE_STRIDE)
+
+#define WAVETABLE_MAGIC   "TSWT"
+#define WAVETABLE_VERSION 2
+#define WAVETABLE_ORDER   0x01020304u
+
+typedef struct
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t size;
+    uint32_t count;
+    uint32_t levels;
+} Wavetable_header;
+
+static float *tables = NULL;
+
+// highest harmonic kept in a level; each level halves the bandwidth
+static int wavetable_harmonics(int level)
+{
+    int harmonics = (WAVETABLE_SIZE / 2) >> level;
+    return harmonics < WAVETABLE_SIZE / 2 ? harmonics : WAVETABLE_SIZE / 2 - 1;
+}
+
+// Fourier amplitude of harmonic h, from the OSCILLATOR_TYPES table
+static double wavetable_partial(Oscillator_type type, int h, int *cosine)
+{
+    switch (type)
+    {
+#define X(id, partial, cos_phase) case id: *cosine = cos_phase; return partial;
+    OSCILLATOR_TYPES(X)
+#undef X
+    default:
+        *cosine = 0;
+        return 0.0;
+    }
+}
+
+// additive synthesis; sin(2 pi h k / N) is read from one period of a sine
+// at index h * k mod N, so no trigonometry runs per partial
+static int wavetables_generate(float *data)
+{
+    double *sine = malloc(WAVETABLE_SIZE * sizeof(double));
+    double *sum = malloc(WAVETABLE_SIZE * sizeof(double));
+    if (!sine || !sum)
+    {
+        free(sine);
+        free(sum);
+        return 0;
+    }
+    
+    for (size_t k = 0; k < WAVETABLE_SIZE; ++k)
+        sine[k] = sin(2.0 * M_PI * (double)k / WAVETABLE_SIZE);
+    
+    for (int type = 0; type < WAVETABLE_COUNT; ++type)
+    {
+        // the levels only differ by where the series stops, so the sum is
+        // built from the top level down and snapshotted at each cut-off
+        memset(sum, 0, WAVETABLE_SIZE * sizeof(double));
+        int h = 1;
+        for (int level = WAVETABLE_LEVELS - 1; level >= 0; --level)
+        {
+            for (; h <= wavetable_harmonics(level); ++h)
+            {
+                int cosine;
+                double amp = wavetable_partial((Oscillator_type)type, h, &cosine);
+                if (amp == 0.0) continue;
+                
+                size_t shift = cosine ? WAVETABLE_SIZE / 4 : 0;
+                for (size_t k = 0; k < WAVETABLE_SIZE; ++k)
+                    sum[k] += amp * sine[((size_t)h * k + shift) & (WAVETABLE_SIZE - 1)];
+            }
+            
+            float *table = data + ((size_t)type * WAVETABLE_LEVELS + level) * WAVETABLE_STRIDE;
+            for (size_t k = 0; k < WAVETABLE_SIZE; ++k)
+                table[k] = (float)sum[k];
+            table[WAVETABLE_SIZE] = table[0];
+        }
+    }
+    
+    free(sine);
+    free(sum);
+    return 1;
+}
+
+static Wavetable_header wavetables_header(void)
+{
+    Wavetable_header header;
+    memcpy(header.magic, WAVETABLE_MAGIC, 4);
+    header.version = WAVETABLE_VERSION;
+    header.byte_order = WAVETABLE_ORDER;
+    header.size = WAVETABLE_SIZE;
+    header.count = WAVETABLE_COUNT;
+    header.levels = WAVETABLE_LEVELS;
+    return header;
+}
+
+// a cache written by another version or on another byte order is ignored
+static int wavetables_load(float *data, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    
+    Wavetable_header expected = wavetables_header();
+    Wavetable_header header;
+    int ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+             memcmp(&header, &expected, sizeof(header)) == 0 &&
+             fread(data, sizeof(float), WAVETABLE_FLOATS, fp) == WAVETABLE_FLOATS;
+    fclose(fp);
+    return ok;
+}
+
+static int wavetables_save(const float *data, const char *path)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return 0;
+    
+    Wavetable_header header = wavetables_header();
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             fwrite(data, sizeof(float), WAVETABLE_FLOATS, fp) == WAVETABLE_FLOATS;
+    if (fclose(fp) != 0) ok = 0;
+    return ok;
+}
+
+// builds the tables once, from cache_path when it holds a valid cache;
+// otherwise they are generated and, given a path, written back to it. A
+// cache that cannot be written is not an error.
+int wavetables_init(const char *cache_path)
+{
+    if (tables) return 1;
+    
+    float *data = malloc(WAVETABLE_FLOATS * sizeof(float));
+    if (!data) return 0;
+    
+    if (!cache_path || !wavetables_load(data, cache_path))
+    {
+        if (!wavetables_generate(data))
+        {
+            free(data);
+            return 0;
+        }
+        if (cache_path)
+            wavetables_save(data, cache_path);
+    }
+    
+    tables = data;
+    return 1;
+}
+
+void wavetables_free(void)
+{
+    free(tables);
+    tables = NULL;
+}
+
+const float *wavetables_data(void)
+{
+    return tables;
+}
+
+// picks the richest level whose top harmonic stays below Nyquist at this
+// phase increment
+int32_t wavetable_offset(Oscillator_type type, double phase_increment)
+{
+    int level = 0;
+    while (level < WAVETABLE_LEVELS - 1 && wavetable_harmonics(level) * phase_increment >= 0.5)
+        ++level;
+    return ((int32_t)type * WAVETABLE_LEVELS + level) * WAVETABLE_STRIDE;
+}
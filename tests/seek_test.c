@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+// A render started with -t must sound like the same stretch of the full
+// render. Resumed voices come back with their filters at rest, so the
+// samples are not expected to match exactly; the loudness of every window
+// and the error over the whole render are.
+
+#define WINDOW_FRAMES  2048
+#define SILENCE_DB     -60.0
+#define MAX_WINDOW_DB  0.1
+#define MIN_SNR_DB     60.0
+
+typedef struct
+{
+    float   *samples;
+    uint64_t frames;
+    uint16_t channels;
+} Wav;
+
+static uint32_t read_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// 32-bit float PCM only, which is what tinysynth writes
+static int read_wav(const char *path, Wav *wav)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        printf("%s: cannot open\n", path);
+        return 0;
+    }
+
+    uint8_t header[12];
+    uint8_t chunk[8];
+    int ok = fread(header, 1, 12, fp) == 12 && memcmp(header, "RIFF", 4) == 0 &&
+             memcmp(header + 8, "WAVE", 4) == 0;
+    wav->samples = NULL;
+    wav->channels = 0;
+    while (ok && fread(chunk, 1, 8, fp) == 8)
+    {
+        uint32_t size = read_u32(chunk + 4);
+        if (memcmp(chunk, "fmt ", 4) == 0)
+        {
+            uint8_t fmt[16];
+            if (size < 16 || fread(fmt, 1, 16, fp) != 16) { ok = 0; break; }
+            uint16_t format = (uint16_t)(fmt[0] | fmt[1] << 8);
+            uint16_t bits = (uint16_t)(fmt[14] | fmt[15] << 8);
+            wav->channels = (uint16_t)(fmt[2] | fmt[3] << 8);
+            if ((format != 3 && format != 0xFFFE) || bits != 32 || wav->channels == 0) { ok = 0; break; }
+            fseek(fp, (long)(size - 16 + (size & 1)), SEEK_CUR);
+        }
+        else if (memcmp(chunk, "data", 4) == 0 && wav->channels)
+        {
+            wav->frames = size / (4u * wav->channels);
+            wav->samples = malloc((size_t)wav->frames * wav->channels * sizeof(float));
+            ok = wav->samples &&
+                 fread(wav->samples, sizeof(float) * wav->channels, (size_t)wav->frames, fp) == wav->frames;
+            break;
+        }
+        else
+        {
+            fseek(fp, (long)(size + (size & 1)), SEEK_CUR);
+        }
+    }
+    fclose(fp);
+
+    if (!ok || !wav->samples)
+    {
+        printf("%s: not a float WAV file\n", path);
+        free(wav->samples);
+        wav->samples = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+static double to_db(double energy, double frames)
+{
+    return energy > 0.0 ? 10.0 * log10(energy / frames) : -200.0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        printf("Usage: %s <full.wav> <seek.wav> <start_seconds>\n", argv[0]);
+        return 1;
+    }
+
+    Wav full, seek;
+    if (!read_wav(argv[1], &full)) return 1;
+    if (!read_wav(argv[2], &seek))
+    {
+        free(full.samples);
+        return 1;
+    }
+
+    // tinysynth renders at 44.1 kHz and truncates the start time the same way
+    uint64_t start = (uint64_t)(atof(argv[3]) * 44100.0);
+    int failed = 0;
+    if (full.channels != seek.channels || start + seek.frames != full.frames)
+    {
+        printf("seek: %llu frames after %llu, the full render has %llu\n",
+               (unsigned long long)seek.frames, (unsigned long long)start, (unsigned long long)full.frames);
+        failed = 1;
+    }
+
+    double signal = 0.0, error = 0.0;
+    size_t worst_window = 0;
+    double worst_db = 0.0;
+    uint64_t frames = seek.frames < full.frames - start ? seek.frames : full.frames - start;
+    for (uint64_t w = 0; !failed && w < frames; w += WINDOW_FRAMES)
+    {
+        uint64_t end = w + WINDOW_FRAMES < frames ? w + WINDOW_FRAMES : frames;
+        const float *a = full.samples + (start + w) * full.channels;
+        const float *b = seek.samples + w * seek.channels;
+        double ea = 0.0, eb = 0.0, ed = 0.0;
+        for (uint64_t i = 0; i < (end - w) * full.channels; ++i)
+        {
+            ea += (double)a[i] * a[i];
+            eb += (double)b[i] * b[i];
+            ed += ((double)a[i] - b[i]) * ((double)a[i] - b[i]);
+        }
+        signal += ea;
+        error += ed;
+
+        double n = (double)((end - w) * full.channels);
+        double da = to_db(ea, n), db = to_db(eb, n);
+        if ((da > SILENCE_DB || db > SILENCE_DB) && fabs(da - db) > worst_db)
+        {
+            worst_db = fabs(da - db);
+            worst_window = (size_t)(w / WINDOW_FRAMES);
+        }
+    }
+
+    double snr = error > 0.0 ? 10.0 * log10(signal / error) : 200.0;
+    if (!failed)
+    {
+        printf("seek to %ss: worst window %.2f dB off at %.2fs, %.1f dB signal to error\n",
+               argv[3], worst_db, (double)start / 44100.0 + worst_window * WINDOW_FRAMES / 44100.0, snr);
+        failed = worst_db > MAX_WINDOW_DB || snr < MIN_SNR_DB;
+    }
+    printf("seek: %s\n", failed ? "FAILED" : "ok");
+
+    free(full.samples);
+    free(seek.samples);
+    return failed;
+}
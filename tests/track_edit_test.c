@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "midi_parser.h"
+#include "midi_preprocessor.h"
+
+// Random splices with apply_track_edit must leave the tempo map and the
+// timeline exactly as build_tempo_map and merge_tracks_to_timeline would
+// build them from the edited file.
+
+#define EDITS_PER_FILE 500
+#define MAX_INSERT     6
+#define SAMPLE_RATE    44100
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(uint32_t bound)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state % bound;
+}
+
+static uint64_t tick_before(const MTrk *track, size_t first)
+{
+    uint64_t tick = 0;
+    for (size_t k = 0; k < first; ++k)
+        tick += track->events[k].delta_time;
+    return tick;
+}
+
+// a note or, one time in six, a tempo change
+static MTrk_event random_event(void)
+{
+    MTrk_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.delta_time = rng(4) == 0 ? 0 : rng(500);
+    if (rng(6) == 0)
+    {
+        uint32_t us_per_qn = 200000 + rng(800000);
+        uint8_t *data = malloc(3);
+        data[0] = (uint8_t)(us_per_qn >> 16);
+        data[1] = (uint8_t)(us_per_qn >> 8);
+        data[2] = (uint8_t)us_per_qn;
+        ev.kind = META;
+        ev.meta_ev.type = 0x51;
+        ev.meta_ev.len  = 3;
+        ev.meta_ev.data = data;
+    }
+    else
+    {
+        ev.kind = CH;
+        ev.channel_ev.type    = rng(2) ? 0x9 : 0x8;
+        ev.channel_ev.channel = rng(16);
+        ev.channel_ev.param1  = rng(128);
+        ev.channel_ev.param2  = rng(128);
+    }
+    return ev;
+}
+
+static int same_tempo_map(const Tempo_map *a, const Tempo_map *b)
+{
+    if (a->count != b->count) return 0;
+    for (size_t i = 0; i < a->count; ++i)
+    {
+        const Tempo_change *x = &a->changes[i];
+        const Tempo_change *y = &b->changes[i];
+        if (x->tick != y->tick || x->us_per_qn != y->us_per_qn ||
+            x->track_idx != y->track_idx || x->event_idx != y->event_idx) return 0;
+    }
+    return 1;
+}
+
+static int same_timeline(const Timeline *a, const Timeline *b)
+{
+    if (a->count != b->count) return 0;
+    for (size_t i = 0; i < a->count; ++i)
+    {
+        const Timed_event *x = &a->events[i];
+        const Timed_event *y = &b->events[i];
+        if (x->tick != y->tick || x->track_idx != y->track_idx || x->event != y->event ||
+            x->sample != y->sample || x->timestamp_ms != y->timestamp_ms) return 0;
+    }
+    return 1;
+}
+
+// with_timeline = 0 patches the tempo map alone
+static int check_file(const char *path, int with_timeline)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        printf("%s: cannot open\n", path);
+        return 0;
+    }
+    int status;
+    MIDI_file midi = get_MIDI_file(fp, &status);
+    fclose(fp);
+    if (status != 0)
+    {
+        printf("%s: cannot parse\n", path);
+        return 0;
+    }
+
+    Tempo_map tmap = build_tempo_map(&midi, &status);
+    Timeline timeline = { 0 };
+    if (with_timeline)
+        timeline = merge_tracks_to_timeline(&midi, &tmap, SAMPLE_RATE, &status);
+
+    int ok = 1;
+    for (int e = 0; ok && e < EDITS_PER_FILE; ++e)
+    {
+        uint16_t t = (uint16_t)rng(midi.mthd.ntracks);
+        MTrk *track = &midi.mtrk[t];
+        MTrk_event insert[MAX_INSERT];
+
+        Track_edit edit;
+        edit.track_idx    = t;
+        edit.first        = rng((uint32_t)track->count + 1);
+        edit.tick         = tick_before(track, edit.first);
+        edit.remove_count = rng((uint32_t)(track->count - edit.first < MAX_INSERT ? track->count - edit.first + 1 : MAX_INSERT));
+        edit.insert       = insert;
+        edit.insert_count = rng(MAX_INSERT + 1);
+        if (rng(3) == 0 && edit.remove_count > 0)
+        {
+            // rewrite notes in place, keeping their times
+            edit.insert_count = 0;
+            for (size_t k = 0; k < edit.remove_count; ++k)
+            {
+                if (track->events[edit.first + k].kind != CH) break;
+                insert[k] = track->events[edit.first + k];
+                insert[k].channel_ev.param1 = rng(128);
+                edit.insert_count++;
+            }
+            edit.remove_count = edit.insert_count;
+        }
+        else
+        {
+            for (size_t k = 0; k < edit.insert_count; ++k)
+                insert[k] = random_event();
+        }
+
+        if (with_timeline && edit.first > 0)
+        {
+            Track_edit wrong = edit;
+            wrong.tick += 1 + rng(3);
+            if (apply_track_edit(&midi, &tmap, &timeline, &wrong))
+            {
+                printf("%s: edit %d: a wrong tick was accepted\n", path, e);
+                ok = 0;
+                break;
+            }
+        }
+        if (!apply_track_edit(&midi, &tmap, with_timeline ? &timeline : NULL, &edit))
+        {
+            printf("%s: edit %d failed\n", path, e);
+            ok = 0;
+            break;
+        }
+
+        Tempo_map ref_tmap = build_tempo_map(&midi, &status);
+        if (!same_tempo_map(&tmap, &ref_tmap))
+        {
+            printf("%s: edit %d: tempo map differs from a rebuild\n", path, e);
+            ok = 0;
+        }
+        if (ok && with_timeline)
+        {
+            Timeline ref = merge_tracks_to_timeline(&midi, &ref_tmap, SAMPLE_RATE, &status);
+            if (!same_timeline(&timeline, &ref))
+            {
+                printf("%s: edit %d: timeline differs from a rebuild\n", path, e);
+                ok = 0;
+            }
+            free_timeline(&ref);
+        }
+        free_tempo_map(&ref_tmap);
+    }
+
+    free_timeline(&timeline);
+    free_tempo_map(&tmap);
+    free_MIDI_file(&midi);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <input.mid>...\n", argv[0]);
+        return 1;
+    }
+
+    int failed = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        for (int with_timeline = 1; with_timeline >= 0; --with_timeline)
+        {
+            if (!check_file(argv[i], with_timeline)) failed = 1;
+        }
+    }
+    printf("track edits: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}